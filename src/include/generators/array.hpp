@@ -1,6 +1,8 @@
 #pragma once
 
 #include <memory>
+#include <string_view>
+#include <type_traits>
 
 #include <arrow/api.h>
 
@@ -15,20 +17,28 @@ GenerateArray(Builder &builder, Distribution &distribution, size_t size,
   using Value = typename Distribution::result_type;
   static const size_t batch_size = (1 << 12) / sizeof(Value);
 
-  std::vector<Value> buffer(std::min(size, batch_size));
-
-  while (size) {
-    if (size >= batch_size) {
-      size -= batch_size;
-    } else {
-      buffer.resize(size);
-      size = 0;
+  if constexpr (std::is_same_v<Value, std::string_view>) {
+    // views die on the next draw, so they are appended one by one
+    ARROW_RETURN_NOT_OK(builder.Reserve(size));
+    while (size--) {
+      ARROW_RETURN_NOT_OK(builder.Append(distribution(gen)));
     }
-
-    for (auto &el : buffer) {
-      el = distribution(gen);
+  } else {
+    std::vector<Value> buffer(std::min(size, batch_size));
+
+    while (size) {
+      if (size >= batch_size) {
+        size -= batch_size;
+      } else {
+        buffer.resize(size);
+        size = 0;
+      }
+
+      for (auto &el : buffer) {
+        el = distribution(gen);
+      }
+      ARROW_RETURN_NOT_OK(builder.AppendValues(buffer));
     }
-    ARROW_RETURN_NOT_OK(builder.AppendValues(buffer));
   }
 
   ARROW_ASSIGN_OR_RAISE(auto result, builder.Finish());
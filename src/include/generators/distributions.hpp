@@ -2,6 +2,8 @@
 
 #include <concepts>
 #include <random>
+#include <string>
+#include <string_view>
 #include <utility>
 
 namespace generators {
@@ -29,9 +31,10 @@ private:
   result_type last_;
 };
 
+// Values view a buffer of the distribution and live until the next call
 class RandomString {
 public:
-  using result_type = std::string;
+  using result_type = std::string_view;
 
   RandomString(size_t max = 16, size_t min = 0) : distribution_(min, max) {}
 
@@ -42,13 +45,12 @@ public:
   template <class Generator> result_type operator()(Generator &gen) {
     const size_t size = distribution_(gen);
 
-    std::string result;
-    result.resize(size);
-    for (auto &c : result) {
+    buffer_.resize(size);
+    for (auto &c : buffer_) {
       c = kAlphaNum[kCharDistribution(gen)];
     }
 
-    return result;
+    return buffer_;
   }
 
 private:
@@ -62,6 +64,7 @@ private:
 
 private:
   std::uniform_int_distribution<size_t> distribution_;
+  std::string buffer_;
 };
 
 namespace details {
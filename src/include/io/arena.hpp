@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <io/literals.hpp>
+
+namespace io {
+
+// Bump allocator for the bytes of variable length fields. Blocks are kept on
+// Reset, so a buffer that is refilled block after block stops allocating once
+// it has grown to its working size.
+class Arena {
+  static constexpr size_t kBlockSize = 1_MiB;
+
+public:
+  Arena() = default;
+
+  Arena(const Arena &) = delete;
+  Arena(Arena &&) = default;
+  Arena &operator=(Arena &&) = default;
+
+  // Copies `str` into the arena, the view lives until the next Reset
+  std::string_view Store(std::string_view str) {
+    if (str.empty()) {
+      return {};
+    }
+
+    char *dst = Allocate(str.size());
+    std::memcpy(dst, str.data(), str.size());
+    return {dst, str.size()};
+  }
+
+  // Invalidates every stored view and rewinds to the first block
+  void Reset() {
+    current_ = 0;
+    used_ = 0;
+  }
+
+  // Frees the blocks too
+  void Release() {
+    Reset();
+    blocks_.clear();
+    blocks_.shrink_to_fit();
+  }
+
+private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  char *Allocate(size_t size) {
+    while (current_ != blocks_.size() && used_ + size > blocks_[current_].size) {
+      ++current_;
+      used_ = 0;
+    }
+
+    if (current_ == blocks_.size()) {
+      const size_t block_size = std::max(size, kBlockSize);
+      blocks_.push_back({std::make_unique<char[]>(block_size), block_size});
+      used_ = 0;
+    }
+
+    char *ptr = blocks_[current_].data.get() + used_;
+    used_ += size;
+    return ptr;
+  }
+
+private:
+  std::vector<Block> blocks_;
+  size_t current_ = 0;
+  size_t used_ = 0;
+};
+
+// Rows with string_view fields view the read buffer of their stream (the
+// spill buffer or the Arrow batch) and stay valid until the next read from
+// it, anything that keeps rows longer stores them into an arena
+template <class T>
+concept ArenaBacked = requires(T &row, Arena &arena) { row.Store(arena); };
+
+} // namespace io
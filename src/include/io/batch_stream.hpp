@@ -1,15 +1,106 @@
 #pragma once
 
 #include <__memory/construct_at.h>
+#include <algorithm>
+#include <arrow/compute/api.h>
 #include <arrow/dataset/file_parquet.h>
+#include <future>
+#include <iostream>
+#include <limits>
 #include <memory>
+#include <optional>
 #include <parquet/arrow/writer.h>
 #include <parquet/file_writer.h>
+#include <parquet/statistics.h>
 
+#include <io/arena.hpp>
 #include <io/settings.hpp>
 
 namespace io {
 
+namespace details {
+
+// Reorders (and drops extra) columns of `batch` to match T's schema
+template <class T>
+std::shared_ptr<arrow::RecordBatch>
+Project(const std::shared_ptr<arrow::RecordBatch> &batch) {
+  std::vector<int> fields;
+  for (const auto &field : T::kSchema->fields()) {
+    fields.push_back(batch->schema()->GetFieldIndex(field->name()));
+  }
+
+  std::shared_ptr<arrow::RecordBatch> projected;
+  PARQUET_ASSIGN_OR_THROW(projected, batch->SelectColumns(fields));
+  return projected;
+}
+
+} // namespace details
+
+// Min and max of an integral column chunk taken from its statistics, as
+// unsigned values. Signed statistics map onto them only while the minimum
+// is not negative.
+inline std::optional<std::pair<uint64_t, uint64_t>>
+RowGroupMinMax(const parquet::RowGroupMetaData &row_group, int column) {
+  const auto stats = row_group.ColumnChunk(column)->statistics();
+  if (!stats || !stats->HasMinMax()) {
+    return std::nullopt;
+  }
+
+  const auto &logical = row_group.schema()->Column(column)->logical_type();
+  const bool is_signed =
+      !logical || !logical->is_int() ||
+      static_cast<const parquet::IntLogicalType &>(*logical).is_signed();
+
+  switch (stats->physical_type()) {
+  case parquet::Type::INT64: {
+    const auto &typed = static_cast<const parquet::Int64Statistics &>(*stats);
+    if (is_signed && typed.min() < 0) {
+      return std::nullopt;
+    }
+    return std::pair{static_cast<uint64_t>(typed.min()),
+                     static_cast<uint64_t>(typed.max())};
+  }
+  case parquet::Type::INT32: {
+    const auto &typed = static_cast<const parquet::Int32Statistics &>(*stats);
+    if (is_signed && typed.min() < 0) {
+      return std::nullopt;
+    }
+    return std::pair<uint64_t, uint64_t>{static_cast<uint32_t>(typed.min()),
+                                         static_cast<uint32_t>(typed.max())};
+  }
+  default:
+    return std::nullopt;
+  }
+}
+
+// Whether the statistics show ascending, non-overlapping row groups, files
+// that are not parquet have no statistics to tell
+inline bool SortedByStatistics(const std::string &filename,
+                               const std::string &column_name) {
+  std::shared_ptr<parquet::FileMetaData> metadata;
+  try {
+    metadata = parquet::ParquetFileReader::OpenFile(filename)->metadata();
+  } catch (const parquet::ParquetException &) {
+    return false;
+  }
+  const int column = metadata->schema()->ColumnIndex(column_name);
+  if (column < 0) {
+    return false;
+  }
+
+  uint64_t prev_max = 0;
+  for (int row_group = 0; row_group != metadata->num_row_groups();
+       ++row_group) {
+    const auto range = RowGroupMinMax(*metadata->RowGroup(row_group), column);
+    if (!range || range->first < prev_max) {
+      return false;
+    }
+    prev_max = range->second;
+  }
+
+  return true;
+}
+
 template <class T> class BatchIStream {
   static constexpr int kGroupsPerFetch = 1;
 
@@ -19,16 +110,25 @@ public:
   BatchIStream() = default;
 
   BatchIStream(const std::string &filename, const ParquetSettings &settings)
-      : last_row_group_(0), inds_(kGroupsPerFetch) {
+      : BatchIStream(filename, settings, std::nullopt) {}
+
+  // Reads only the columns of T and, if a predicate is given, skips row
+  // groups whose statistics cannot match and drops non-matching rows before
+  // they are converted
+  BatchIStream(const std::string &filename, const ParquetSettings &settings,
+               std::optional<RangePredicate> predicate)
+      : predicate_(std::move(predicate)), inds_(kGroupsPerFetch) {
     parquet::arrow::FileReaderBuilder reader_builder;
     PARQUET_THROW_NOT_OK(
         reader_builder.OpenFile(filename, false, settings.reader_props));
-    reader_builder.memory_pool(arrow::default_memory_pool());
+    reader_builder.memory_pool(settings.memory_pool);
     reader_builder.properties(settings.arrow_reader_props);
 
     PARQUET_ASSIGN_OR_THROW(arrow_reader_, reader_builder.Build());
     // PARQUET_THROW_NOT_OK(arrow_reader_->GetRecordBatchReader(&rb_reader_));
 
+    SelectColumns();
+    SelectRowGroups();
     Fetch();
   }
 
@@ -39,6 +139,7 @@ public:
   bool Eof() const { return !batch_; }
 
   BatchIStream &operator>>(T &row) {
+    Release();
     array_.Read(row, last_row_);
     ++last_row_;
 
@@ -49,24 +150,140 @@ public:
     return *this;
   }
 
+  // Reads up to `count` rows, returns the number of rows read
+  size_t Read(T *rows, size_t count) {
+    Release();
+    size_t read = 0;
+
+    while (read != count && !Eof()) {
+      const size_t step =
+          std::min<size_t>(count - read, batch_->num_rows() - last_row_);
+      array_.ReadRange(rows + read, last_row_, step);
+      read += step;
+      last_row_ += step;
+
+      if (batch_->num_rows() == last_row_) {
+        Fetch();
+      }
+    }
+
+    return read;
+  }
+
 private:
+  void SelectColumns() {
+    const auto &schema = *arrow_reader_->parquet_reader()->metadata()->schema();
+
+    const auto add_column = [&](const std::string &name) {
+      const int column = schema.ColumnIndex(name);
+      if (column < 0) {
+        throw std::runtime_error("No column " + name + " in input");
+      }
+      if (std::find(columns_.begin(), columns_.end(), column) ==
+          columns_.end()) {
+        columns_.push_back(column);
+      }
+    };
+
+    for (const auto &field : T::kSchema->fields()) {
+      add_column(field->name());
+    }
+    if (predicate_) {
+      add_column(predicate_->column);
+    }
+  }
+
+  void SelectRowGroups() {
+    const auto metadata = arrow_reader_->parquet_reader()->metadata();
+
+    for (int row_group = 0; row_group != metadata->num_row_groups();
+         ++row_group) {
+      if (!predicate_ || MayMatch(*metadata->RowGroup(row_group))) {
+        row_groups_.push_back(row_group);
+      }
+    }
+  }
+
+  bool MayMatch(const parquet::RowGroupMetaData &row_group) const {
+    const auto range = RowGroupMinMax(
+        row_group, row_group.schema()->ColumnIndex(predicate_->column));
+    return !range || (predicate_->min <= range->second &&
+                      range->first <= predicate_->max);
+  }
+
+  std::shared_ptr<arrow::RecordBatch>
+  Filter(const std::shared_ptr<arrow::RecordBatch> &batch) const {
+    const arrow::Datum column = batch->GetColumnByName(predicate_->column);
+    const auto &type = column.type();
+
+    // the bounds are compared in the column type, clamped to its largest
+    // value, so negative values of a signed column never match
+    uint64_t type_max = std::numeric_limits<uint64_t>::max();
+    if (arrow::is_integer(type->id())) {
+      const int bits =
+          type->bit_width() - arrow::is_signed_integer(type->id());
+      if (bits < 64) {
+        type_max = (uint64_t{1} << bits) - 1;
+      }
+    }
+    if (predicate_->min > type_max) {
+      return batch->Slice(0, 0);
+    }
+
+    arrow::Datum min, max;
+    PARQUET_ASSIGN_OR_THROW(
+        min, arrow::compute::Cast(arrow::Datum(predicate_->min), type));
+    PARQUET_ASSIGN_OR_THROW(
+        max, arrow::compute::Cast(
+                 arrow::Datum(std::min(predicate_->max, type_max)), type));
+
+    arrow::Datum above, below, mask, filtered;
+    PARQUET_ASSIGN_OR_THROW(
+        above, arrow::compute::CallFunction("greater_equal", {column, min}));
+    PARQUET_ASSIGN_OR_THROW(
+        below, arrow::compute::CallFunction("less_equal", {column, max}));
+    PARQUET_ASSIGN_OR_THROW(mask,
+                            arrow::compute::CallFunction("and", {above, below}));
+    PARQUET_ASSIGN_OR_THROW(filtered, arrow::compute::Filter(batch, mask));
+    return filtered.record_batch();
+  }
+
+  // Rows with string_view fields view the batches they were read from, those
+  // are kept until the next read
+  void Release() {
+    if constexpr (ArenaBacked<T>) {
+      retained_.clear();
+    }
+  }
+
   void Fetch() {
     last_row_ = 0;
+    if constexpr (ArenaBacked<T>) {
+      if (batch_) {
+        retained_.push_back(std::move(batch_));
+      }
+    }
 
     // TODO: previous batches wont flush from ram, idk
     // PARQUET_THROW_NOT_OK(rb_reader_->ReadNext(&batch_));
 
-    if (last_row_group_ != arrow_reader_->num_row_groups()) {
-      const int step = std::min(
-          arrow_reader_->num_row_groups() - last_row_group_, kGroupsPerFetch);
+    if (last_row_group_ != row_groups_.size()) {
+      const size_t step =
+          std::min(row_groups_.size() - last_row_group_, size_t{kGroupsPerFetch});
 
-      inds_.resize(step);
-      std::iota(inds_.begin(), inds_.end(), last_row_group_);
+      inds_.assign(row_groups_.begin() + last_row_group_,
+                   row_groups_.begin() + last_row_group_ + step);
       last_row_group_ += step;
 
       std::shared_ptr<::arrow::Table> table;
-      PARQUET_THROW_NOT_OK(arrow_reader_->ReadRowGroups(inds_, &table));
+      PARQUET_THROW_NOT_OK(
+          arrow_reader_->ReadRowGroups(inds_, columns_, &table));
       PARQUET_ASSIGN_OR_THROW(batch_, table->CombineChunksToBatch());
+
+      if (predicate_) {
+        batch_ = Filter(batch_);
+      }
+      batch_ = details::Project<T>(batch_);
     } else {
       batch_.reset();
     }
@@ -80,13 +297,17 @@ private:
 
 private:
   std::unique_ptr<parquet::arrow::FileReader> arrow_reader_;
-  int last_row_group_;
+  std::optional<RangePredicate> predicate_;
+  std::vector<int> columns_;
+  std::vector<int> row_groups_;
+  size_t last_row_group_ = 0;
 
   //   std::shared_ptr<::arrow::RecordBatchReader> rb_reader_;
 
   std::vector<int> inds_;
   std::shared_ptr<arrow::RecordBatch> batch_;
   int64_t last_row_;
+  std::vector<std::shared_ptr<arrow::RecordBatch>> retained_;
 
   typename T::BatchArray array_;
 };
@@ -103,25 +324,52 @@ public:
                             arrow::io::FileOutputStream::Open(filename));
     PARQUET_ASSIGN_OR_THROW(
         writer_, parquet::arrow::FileWriter::Open(
-                     *T::kSchema.get(), arrow::default_memory_pool(), outfile_,
-                     settings.writer_props, settings.arrow_writer_props));
+                     *T::kSchema.get(), settings.memory_pool, outfile_,
+                     settings.WriterProps(*T::kSchema),
+                     settings.arrow_writer_props));
   }
 
   BatchOStream(const BatchOStream &) = delete;
   BatchOStream(BatchOStream &&) = default;
   BatchOStream &operator=(BatchOStream &&ostream) {
-    if (builder_.Size()) {
-      Flush();
-    }
     std::destroy_at(this);
     std::construct_at(this, std::move(ostream));
     return *this;
   }
 
+  // Errors of a stream that was not closed can only be logged, a destructor
+  // that throws during unwinding terminates the process
   ~BatchOStream() {
-    if (builder_.Size()) {
-      Flush();
+    arrow::Status status;
+    try {
+      status = Close();
+    } catch (const std::exception &error) {
+      status = arrow::Status::UnknownError(error.what());
+    }
+    if (!status.ok()) {
+      std::cerr << "BatchOStream: " << status.ToString() << std::endl;
+    }
+  }
+
+  // Writes the remaining rows and the footer, reports the first error of
+  // the background writes. The stream is unusable afterwards.
+  arrow::Status Close() {
+    if (!writer_) {
+      return arrow::Status::OK();
+    }
+
+    arrow::Status status = Wait();
+    if (status.ok() && builder_.Size()) {
+      status = writer_->WriteRecordBatch(*builder_.Finish());
     }
+    if (status.ok()) {
+      status = writer_->Close();
+    }
+    writer_.reset();
+    if (status.ok()) {
+      status = outfile_->Close();
+    }
+    return status;
   }
 
   BatchOStream &operator<<(const T &row) {
@@ -134,9 +382,33 @@ public:
     return *this;
   }
 
+  void Write(const T *rows, size_t count) {
+    while (count) {
+      const size_t step = std::min(count, builder_.Capacity() - builder_.Size());
+      builder_.Append(rows, step);
+      rows += step;
+      count -= step;
+
+      if (builder_.Full()) {
+        Flush();
+      }
+    }
+  }
+
 private:
+  // Encoding of a finished batch is handed off to a background task, so the
+  // caller keeps filling the builder while the previous row group is being
+  // written (columns themselves are encoded in parallel, see use_threads).
   void Flush() {
-    PARQUET_THROW_NOT_OK(writer_->WriteRecordBatch(*builder_.Finish()));
+    PARQUET_THROW_NOT_OK(Wait());
+    pending_ = std::async(std::launch::async,
+                          [writer = writer_.get(), batch = builder_.Finish()] {
+                            return writer->WriteRecordBatch(*batch);
+                          });
+  }
+
+  arrow::Status Wait() {
+    return pending_.valid() ? pending_.get() : arrow::Status::OK();
   }
 
 private:
@@ -144,6 +416,7 @@ private:
   std::unique_ptr<parquet::arrow::FileWriter> writer_;
   size_t rows_;
   typename T::BatchBuilder builder_;
+  std::future<arrow::Status> pending_;
 };
 
 } // namespace io
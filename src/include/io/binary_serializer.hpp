@@ -3,6 +3,7 @@
 #include <concepts>
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <type_traits>
 
 namespace io {
@@ -15,6 +16,10 @@ inline size_t SerializedValueSizeOf(const std::string &str) {
   return sizeof(size_t) + str.size();
 }
 
+inline size_t SerializedValueSizeOf(std::string_view str) {
+  return sizeof(size_t) + str.size();
+}
+
 template <std::integral T> void SerializeValue(char *&dst, T val) {
   std::memcpy(dst, &val, sizeof(T));
   dst += sizeof(T);
@@ -26,6 +31,12 @@ inline void SerializeValue(char *&dst, const std::string &str) {
   dst += str.size();
 }
 
+inline void SerializeValue(char *&dst, std::string_view str) {
+  SerializeValue(dst, str.size());
+  std::memcpy(dst, str.data(), str.size());
+  dst += str.size();
+}
+
 template <class T> T DeserializeValue(char *&src);
 
 template <std::integral T> T DeserializeValue(char *&src) {
@@ -42,6 +53,15 @@ template <> inline std::string DeserializeValue<std::string>(char *&src) {
   return str;
 }
 
+// Views the bytes in place, the value lives as long as `src` does
+template <>
+inline std::string_view DeserializeValue<std::string_view>(char *&src) {
+  const size_t size = DeserializeValue<size_t>(src);
+  const std::string_view str(src, size);
+  src += size;
+  return str;
+}
+
 template <auto... Fs, class T> size_t SerializedSizeOf(const T &obj) {
   static_assert((... && std::is_lvalue_reference_v<
                             std::invoke_result_t<decltype(Fs), const T &>>));
@@ -4,162 +4,427 @@
 #include <sys/fcntl.h>
 #include <unistd.h>
 
+#include <future>
+#include <iostream>
+#include <memory>
+
+#include <arrow/util/compression.h>
+#include <parquet/exception.h>
+
+#include <io/arena.hpp>
 #include <io/binary_serializer.hpp>
+#include <io/io_queue.hpp>
 #include <io/settings.hpp>
 
 namespace io {
 
-template <class T> class BinaryIStream {
-public:
-  using type = T;
+namespace details {
 
-  BinaryIStream() = default;
+// Compressed spill runs are a sequence of frames: uncompressed size,
+// compressed size, compressed bytes. A frame always holds whole rows.
+struct FrameHeader {
+  uint64_t size;
+  uint64_t compressed_size;
+};
 
-  BinaryIStream(const std::string &filename, const BufferSettings &settings)
-      : buf_(std::make_unique<char[]>(settings.buffer_size)), ptr_(buf_.get()),
+inline std::unique_ptr<arrow::util::Codec>
+MakeSpillCodec(const SpillOptions &spill) {
+  if (spill.codec == arrow::Compression::UNCOMPRESSED) {
+    return nullptr;
+  }
+
+  std::unique_ptr<arrow::util::Codec> codec;
+  PARQUET_ASSIGN_OR_THROW(codec,
+                          arrow::util::Codec::Create(spill.codec, spill.level));
+  return codec;
+}
+
+inline void WriteAll(int fd, const char *data, size_t size) {
+  while (size) {
+    const ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      throw std::runtime_error("Cant write file");
+    }
+    size -= written;
+    data += written;
+  }
+}
+
+// Reads up to `size` bytes, fewer only at the end of the file
+inline size_t ReadUpTo(int fd, char *data, size_t size) {
+  size_t done = 0;
+  while (done != size) {
+    const ssize_t got = read(fd, data + done, size - done);
+    if (got <= 0) {
+      break;
+    }
+    done += got;
+  }
+  return done;
+}
+
+// Compresses `size` bytes of `data` into `frame` and writes it to `fd`
+inline void WriteFrame(arrow::util::Codec &codec, int fd, const char *data,
+                       size_t size, char *frame) {
+  char *compressed = frame + sizeof(FrameHeader);
+
+  int64_t compressed_size;
+  PARQUET_ASSIGN_OR_THROW(
+      compressed_size,
+      codec.Compress(size, reinterpret_cast<const uint8_t *>(data),
+                     codec.MaxCompressedLen(size, nullptr),
+                     reinterpret_cast<uint8_t *>(compressed)));
+
+  const FrameHeader header{size, static_cast<uint64_t>(compressed_size)};
+  std::memcpy(frame, &header, sizeof(header));
+  WriteAll(fd, frame, sizeof(header) + compressed_size);
+}
+
+// Buffered reader of a spill run, BinaryIStream and KeyedBinaryIStream parse
+// rows out of it. A `stable` reader refills into a second buffer, so bytes of
+// the last record stay in place until the next record is parsed. With
+// read_ahead file bytes come in half buffer chunks read on the device queue.
+class SpillReader {
+public:
+  SpillReader() = default;
+
+  SpillReader(const std::string &filename, const BufferSettings &settings,
+              bool stable = false)
+      : buf_(AcquireBuffer(settings.pool, settings.buffer_size)),
+        ptr_(buf_.get()),
         buffer_size_(settings.buffer_size),
+        codec_(MakeSpillCodec(settings.spill)),
         fd_(open(filename.c_str(), O_RDONLY, S_IRUSR | S_IWUSR)) {
     if (fd_ == -1) {
       throw std::runtime_error("Cant open file");
     }
+    if (codec_) {
+      frame_ = AcquireBuffer(settings.pool,
+                             codec_->MaxCompressedLen(buffer_size_, nullptr));
+    }
+    if (stable) {
+      spare_ = AcquireBuffer(settings.pool, buffer_size_);
+    }
+    if (settings.spill.read_ahead) {
+      queue_ = &DeviceQueue(filename);
+      chunk_size_ = std::max<size_t>(buffer_size_ / 2, 1);
+      staged_ = AcquireBuffer(settings.pool, chunk_size_);
+      ahead_ = AcquireBuffer(settings.pool, chunk_size_);
+      Request();
+    }
 
     Fetch();
   }
 
-  ~BinaryIStream() {
+  ~SpillReader() {
+    if (pending_.valid()) {
+      pending_.wait();
+    }
     if (buf_) {
       close(fd_);
     }
   }
 
-  BinaryIStream(const BinaryIStream &) = delete;
-  BinaryIStream(BinaryIStream &&) = default;
-  BinaryIStream &operator=(BinaryIStream &&ostream) {
+  SpillReader(const SpillReader &) = delete;
+  SpillReader(SpillReader &&) = default;
+  SpillReader &operator=(SpillReader &&reader) {
     std::destroy_at(this);
-    std::construct_at(this, std::move(ostream));
+    std::construct_at(this, std::move(reader));
     return *this;
   }
 
   bool Eof() const { return left_ == 0; }
 
-  BinaryIStream &operator>>(T &row) {
-    size_t size;
-
-    if (left_ < sizeof(size_t)) {
-      Fetch();
-    }
-    size = io::DeserializeValue<size_t>(ptr_);
-    left_ -= sizeof(size_t);
+  char *Data() { return ptr_; }
 
+  // Makes the next `size` bytes contiguous, returns where they start
+  char *Need(size_t size) {
     if (left_ < size) {
       Fetch();
     }
+    return ptr_;
+  }
 
-    row.Deserialize(ptr_);
+  void Skip(size_t size) {
     ptr_ += size;
     left_ -= size;
 
     if (!left_) {
       Fetch();
     }
-    return *this;
   }
 
 private:
   void Fetch() {
-    std::memcpy(buf_.get(), ptr_, left_);
+    if (spare_) {
+      std::memcpy(spare_.get(), ptr_, left_);
+      std::swap(buf_, spare_);
+    } else {
+      std::memmove(buf_.get(), ptr_, left_);
+    }
     ptr_ = buf_.get();
 
-    size_t size;
-    do {
-      size = read(fd_, ptr_ + left_, buffer_size_ - left_);
-      left_ += size;
-    } while (size != 0 && buffer_size_ != left_);
+    if (codec_) {
+      FetchFrame();
+      return;
+    }
+
+    left_ += ReadFile(ptr_ + left_, buffer_size_ - left_);
+  }
+
+  void FetchFrame() {
+    FrameHeader header;
+    if (ReadFile(reinterpret_cast<char *>(&header), sizeof(header)) !=
+        sizeof(header)) {
+      return;
+    }
+    if (header.size > buffer_size_ - left_ ||
+        ReadFile(frame_.get(), header.compressed_size) !=
+            header.compressed_size) {
+      throw std::runtime_error("Corrupt spill frame");
+    }
+
+    // codecs expect the exact decompressed size
+    PARQUET_THROW_NOT_OK(
+        codec_
+            ->Decompress(header.compressed_size,
+                         reinterpret_cast<uint8_t *>(frame_.get()),
+                         header.size, reinterpret_cast<uint8_t *>(ptr_ + left_))
+            .status());
+    left_ += header.size;
+  }
+
+  // Reads up to `size` next bytes of the file, fewer only at its end
+  size_t ReadFile(char *dst, size_t size) {
+    if (!queue_) {
+      return ReadUpTo(fd_, dst, size);
+    }
+
+    size_t done = 0;
+    while (done != size && (staged_left_ || Receive())) {
+      const size_t step = std::min(size - done, staged_left_);
+      std::memcpy(dst + done, staged_ptr_, step);
+      staged_ptr_ += step;
+      staged_left_ -= step;
+      done += step;
+    }
+    return done;
+  }
+
+  // Reads the chunk after the staged one in the background
+  void Request() {
+    pending_ = queue_->Submit(
+        [fd = fd_, dst = ahead_.get(), size = chunk_size_] {
+          return ReadUpTo(fd, dst, size);
+        });
+  }
+
+  // Stages the chunk read ahead, returns false at the end of the file
+  bool Receive() {
+    if (!pending_.valid()) {
+      return false;
+    }
+
+    staged_left_ = pending_.get();
+    std::swap(staged_, ahead_);
+    staged_ptr_ = staged_.get();
+
+    if (staged_left_ == chunk_size_) {
+      Request();
+    }
+    return staged_left_ != 0;
   }
 
 private:
-  std::unique_ptr<char[]> buf_;
+  PoolBuffer buf_;
   char *ptr_;
   size_t buffer_size_ = 0;
   size_t left_ = 0;
+  PoolBuffer spare_;
+
+  IoQueue *queue_ = nullptr;
+  size_t chunk_size_ = 0;
+  PoolBuffer staged_;
+  PoolBuffer ahead_;
+  char *staged_ptr_ = nullptr;
+  size_t staged_left_ = 0;
+  std::future<size_t> pending_;
+
+  std::unique_ptr<arrow::util::Codec> codec_;
+  PoolBuffer frame_;
 
   int fd_ = -1;
 };
 
-template <class T> class BinaryOStream {
+// Buffered writer of a spill run, a reserved record never straddles a flush
+class SpillWriter {
 public:
-  using type = T;
-
-  BinaryOStream() = default;
+  SpillWriter() = default;
 
-  BinaryOStream(const std::string &filename, const BufferSettings &settings)
-      : buf_(std::make_unique<char[]>(settings.buffer_size)), ptr_(buf_.get()),
+  SpillWriter(const std::string &filename, const BufferSettings &settings)
+      : buf_(AcquireBuffer(settings.pool, settings.buffer_size)),
+        ptr_(buf_.get()),
         buffer_size_(settings.buffer_size), left_(settings.buffer_size),
+        codec_(MakeSpillCodec(settings.spill)),
         fd_(open(filename.c_str(), O_WRONLY | O_SYNC | O_CREAT | O_TRUNC,
                  S_IRUSR | S_IWUSR)) {
     if (fd_ == -1) {
       throw std::runtime_error("Cant open file");
     }
+    if (codec_) {
+      spare_ = AcquireBuffer(settings.pool, buffer_size_);
+      frame_ = AcquireBuffer(
+          settings.pool, sizeof(FrameHeader) +
+                             codec_->MaxCompressedLen(buffer_size_, nullptr));
+    }
   }
 
-  BinaryOStream(const BinaryOStream &) = delete;
-  BinaryOStream(BinaryOStream &&) = default;
-  BinaryOStream &operator=(BinaryOStream &&ostream) {
+  SpillWriter(const SpillWriter &) = delete;
+  SpillWriter(SpillWriter &&) = default;
+  SpillWriter &operator=(SpillWriter &&writer) {
     std::destroy_at(this);
-    std::construct_at(this, std::move(ostream));
+    std::construct_at(this, std::move(writer));
     return *this;
   }
 
-  ~BinaryOStream() {
-    if (buf_) {
-      Flush();
-      close(fd_);
+  // Errors of a writer that was not closed can only be logged, a destructor
+  // that throws during unwinding terminates the process
+  ~SpillWriter() {
+    const arrow::Status status = Close();
+    if (!status.ok()) {
+      std::cerr << "SpillWriter: " << status.ToString() << std::endl;
     }
   }
 
-  BinaryOStream &operator<<(const T &row) {
-    size_t size;
+  // Writes the buffered bytes, waits for the background write and closes
+  // the file, reports the first error. The writer is unusable afterwards.
+  arrow::Status Close() {
+    if (!buf_) {
+      return arrow::Status::OK();
+    }
 
-    if (left_ < sizeof(size_t)) {
+    arrow::Status status;
+    try {
       Flush();
+      Wait();
+    } catch (const std::exception &error) {
+      status = arrow::Status::IOError(error.what());
     }
+    buf_ = {};
+    if (close(fd_) != 0 && status.ok()) {
+      status = arrow::Status::IOError("Cant close spill file");
+    }
+    fd_ = -1;
+    return status;
+  }
 
-    size = row.SerializedSize();
-    io::SerializeValue(ptr_, size);
-    left_ -= sizeof(size_t);
-
+  // Returns room for a record of `size` bytes
+  char *Reserve(size_t size) {
     if (left_ < size) {
       Flush();
     }
+    return ptr_;
+  }
 
-    row.Serialize(ptr_);
+  void Commit(size_t size) {
     ptr_ += size;
     left_ -= size;
-
-    return *this;
   }
 
 private:
   void Flush() {
-    size_t size = ptr_ - buf_.get();
-    ptr_ = buf_.get();
-    do {
-      const size_t written = write(fd_, ptr_, size);
-      size -= written;
-      ptr_ += written;
-    } while (size);
+    const size_t size = ptr_ - buf_.get();
+
+    if (!codec_) {
+      WriteAll(fd_, buf_.get(), size);
+    } else if (size) {
+      // the filled buffer is compressed and written in the background while
+      // rows go to the spare one
+      Wait();
+      std::swap(buf_, spare_);
+      pending_ = std::async(std::launch::async,
+                            [codec = codec_.get(), fd = fd_,
+                             data = spare_.get(), frame = frame_.get(), size] {
+                              WriteFrame(*codec, fd, data, size, frame);
+                            });
+    }
 
     ptr_ = buf_.get();
     left_ = buffer_size_;
   }
 
+  void Wait() {
+    if (pending_.valid()) {
+      pending_.get();
+    }
+  }
+
 private:
-  std::unique_ptr<char[]> buf_;
+  PoolBuffer buf_;
   char *ptr_;
   size_t buffer_size_ = 0;
   size_t left_ = 0;
 
+  std::unique_ptr<arrow::util::Codec> codec_;
+  PoolBuffer spare_;
+  PoolBuffer frame_;
+  std::future<void> pending_;
+
   int fd_ = -1;
 };
 
+} // namespace details
+
+template <class T> class BinaryIStream {
+public:
+  using type = T;
+
+  BinaryIStream() = default;
+
+  BinaryIStream(const std::string &filename, const BufferSettings &settings)
+      : reader_(filename, settings, ArenaBacked<T>) {}
+
+  bool Eof() const { return reader_.Eof(); }
+
+  BinaryIStream &operator>>(T &row) {
+    char *src = reader_.Need(sizeof(size_t));
+    const size_t size = io::DeserializeValue<size_t>(src);
+
+    row.Deserialize(reader_.Need(sizeof(size_t) + size) + sizeof(size_t));
+    reader_.Skip(sizeof(size_t) + size);
+
+    return *this;
+  }
+
+private:
+  details::SpillReader reader_;
+};
+
+template <class T> class BinaryOStream {
+public:
+  using type = T;
+
+  BinaryOStream() = default;
+
+  BinaryOStream(const std::string &filename, const BufferSettings &settings)
+      : writer_(filename, settings) {}
+
+  // See SpillWriter::Close
+  arrow::Status Close() { return writer_.Close(); }
+
+  BinaryOStream &operator<<(const T &row) {
+    const size_t size = row.SerializedSize();
+
+    char *dst = writer_.Reserve(sizeof(size_t) + size);
+    io::SerializeValue(dst, size);
+    row.Serialize(dst);
+    writer_.Commit(sizeof(size_t) + size);
+
+    return *this;
+  }
+
+private:
+  details::SpillWriter writer_;
+};
+
 } // namespace io
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <utility>
+
+#include <arrow/memory_pool.h>
+#include <arrow/status.h>
+
+namespace io {
+
+class BufferPool;
+
+// Buffer of a spill stream, taken from a BufferPool or from the heap if the
+// pool had no room
+class PoolBuffer {
+public:
+  PoolBuffer() = default;
+
+  // Heap buffer
+  explicit PoolBuffer(size_t size)
+      : data_(new char[size]), size_(size), heap_(true) {}
+
+  PoolBuffer(BufferPool *pool, char *data, size_t size)
+      : pool_(pool), data_(data), size_(size) {}
+
+  PoolBuffer(const PoolBuffer &) = delete;
+  PoolBuffer(PoolBuffer &&other) noexcept { Swap(other); }
+  PoolBuffer &operator=(PoolBuffer &&other) noexcept {
+    PoolBuffer(std::move(other)).Swap(*this);
+    return *this;
+  }
+
+  ~PoolBuffer();
+
+  char *get() const { return data_; }
+  size_t size() const { return size_; }
+  explicit operator bool() const { return data_ != nullptr; }
+
+  void Swap(PoolBuffer &other) noexcept {
+    std::swap(pool_, other.pool_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(heap_, other.heap_);
+  }
+
+private:
+  BufferPool *pool_ = nullptr;
+  char *data_ = nullptr;
+  size_t size_ = 0;
+  bool heap_ = false;
+};
+
+inline void swap(PoolBuffer &lhs, PoolBuffer &rhs) noexcept { lhs.Swap(rhs); }
+
+// One memory budget for the buffers of spill streams and the allocations of
+// Arrow readers and writers. The region is either mapped by the pool
+// (optionally with transparent huge pages) or lent by a sort buffer whose
+// rows are dead, so the same bytes serve run generation and then the merge.
+// Requests that do not fit go to the parent pool, or to the heap if there is
+// none.
+class BufferPool : public arrow::MemoryPool {
+  static constexpr size_t kAlignment = 64;
+
+public:
+  explicit BufferPool(size_t capacity, bool huge_pages = false,
+                      BufferPool *parent = nullptr)
+      : capacity_(capacity), parent_(parent), owned_(true) {
+    void *region = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    if (huge_pages) {
+      madvise(region, capacity_, MADV_HUGEPAGE);
+    }
+
+    region_ = static_cast<char *>(region);
+    free_[0] = capacity_;
+  }
+
+  // Pool over `size` bytes at `data` that the caller keeps alive
+  BufferPool(char *data, size_t size, BufferPool *parent = nullptr)
+      : parent_(parent) {
+    const size_t skip = -reinterpret_cast<uintptr_t>(data) % kAlignment;
+    region_ = data + std::min(skip, size);
+    capacity_ = size - std::min(skip, size);
+    if (capacity_) {
+      free_[0] = capacity_;
+    }
+  }
+
+  BufferPool(const BufferPool &) = delete;
+
+  ~BufferPool() override {
+    if (owned_) {
+      munmap(region_, capacity_);
+    }
+  }
+
+  PoolBuffer Acquire(size_t size) {
+    if (char *data = Take(size)) {
+      return PoolBuffer(this, data, size);
+    }
+    if (parent_) {
+      return parent_->Acquire(size);
+    }
+    return PoolBuffer(size);
+  }
+
+  size_t Capacity() const { return capacity_; }
+
+  // Bytes of the region in use
+  size_t Used() const {
+    std::lock_guard lock(mutex_);
+    return used_;
+  }
+
+  arrow::Status Allocate(int64_t size, int64_t alignment,
+                         uint8_t **out) override {
+    char *data = alignment <= static_cast<int64_t>(kAlignment)
+                     ? Take(size)
+                     : nullptr;
+    if (data) {
+      *out = reinterpret_cast<uint8_t *>(data);
+    } else {
+      ARROW_RETURN_NOT_OK(Fallback()->Allocate(size, alignment, out));
+    }
+
+    Count(size);
+    return arrow::Status::OK();
+  }
+
+  arrow::Status Reallocate(int64_t old_size, int64_t new_size,
+                           int64_t alignment, uint8_t **ptr) override {
+    uint8_t *moved;
+    ARROW_RETURN_NOT_OK(Allocate(new_size, alignment, &moved));
+    std::memcpy(moved, *ptr, std::min(old_size, new_size));
+    Free(*ptr, old_size, alignment);
+    *ptr = moved;
+    return arrow::Status::OK();
+  }
+
+  void Free(uint8_t *buffer, int64_t size, int64_t alignment) override {
+    char *data = reinterpret_cast<char *>(buffer);
+    if (Owns(data)) {
+      Give(data, size);
+    } else {
+      Fallback()->Free(buffer, size, alignment);
+    }
+
+    std::lock_guard lock(mutex_);
+    arrow_bytes_ -= size;
+  }
+
+  int64_t bytes_allocated() const override {
+    std::lock_guard lock(mutex_);
+    return arrow_bytes_;
+  }
+
+  int64_t max_memory() const override {
+    std::lock_guard lock(mutex_);
+    return arrow_max_;
+  }
+
+  int64_t total_bytes_allocated() const override {
+    std::lock_guard lock(mutex_);
+    return arrow_total_;
+  }
+
+  int64_t num_allocations() const override {
+    std::lock_guard lock(mutex_);
+    return arrow_allocations_;
+  }
+
+  std::string backend_name() const override { return "buffer_pool"; }
+
+private:
+  friend class PoolBuffer;
+
+  static size_t Round(size_t size) {
+    return (std::max<size_t>(size, 1) + kAlignment - 1) / kAlignment *
+           kAlignment;
+  }
+
+  bool Owns(const char *data) const {
+    return region_ <= data && data < region_ + capacity_;
+  }
+
+  arrow::MemoryPool *Fallback() {
+    return parent_ ? static_cast<arrow::MemoryPool *>(parent_)
+                   : arrow::default_memory_pool();
+  }
+
+  void Count(int64_t size) {
+    std::lock_guard lock(mutex_);
+    arrow_bytes_ += size;
+    arrow_max_ = std::max(arrow_max_, arrow_bytes_);
+    arrow_total_ += size;
+    ++arrow_allocations_;
+  }
+
+  // First fit from the free list, nullptr if nothing fits
+  char *Take(size_t size) {
+    size = Round(size);
+
+    std::lock_guard lock(mutex_);
+    for (auto it = free_.begin(); it != free_.end(); ++it) {
+      if (it->second < size) {
+        continue;
+      }
+
+      const auto [offset, room] = *it;
+      free_.erase(it);
+      if (room != size) {
+        free_[offset + size] = room - size;
+      }
+      used_ += size;
+      return region_ + offset;
+    }
+    return nullptr;
+  }
+
+  // Returns a block to the free list, merging it with its neighbours
+  void Give(char *data, size_t size) {
+    size = Round(size);
+    size_t offset = data - region_;
+
+    std::lock_guard lock(mutex_);
+    used_ -= size;
+
+    auto next = free_.lower_bound(offset);
+    if (next != free_.begin()) {
+      auto prev = std::prev(next);
+      if (prev->first + prev->second == offset) {
+        offset = prev->first;
+        size += prev->second;
+        free_.erase(prev);
+      }
+    }
+    if (next != free_.end() && offset + size == next->first) {
+      size += next->second;
+      free_.erase(next);
+    }
+    free_[offset] = size;
+  }
+
+private:
+  char *region_ = nullptr;
+  size_t capacity_ = 0;
+  BufferPool *parent_;
+  bool owned_ = false;
+
+  mutable std::mutex mutex_;
+  // offset -> size of free blocks
+  std::map<size_t, size_t> free_;
+  size_t used_ = 0;
+
+  int64_t arrow_bytes_ = 0;
+  int64_t arrow_max_ = 0;
+  int64_t arrow_total_ = 0;
+  int64_t arrow_allocations_ = 0;
+};
+
+inline PoolBuffer::~PoolBuffer() {
+  if (heap_) {
+    delete[] data_;
+  } else if (pool_) {
+    pool_->Give(data_, size_);
+  }
+}
+
+// Buffer of `size` bytes from `pool`, or from the heap without one
+inline PoolBuffer AcquireBuffer(BufferPool *pool, size_t size) {
+  return pool ? pool->Acquire(size) : PoolBuffer(size);
+}
+
+} // namespace io
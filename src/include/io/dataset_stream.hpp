@@ -0,0 +1,113 @@
+#pragma once
+
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <io/batch_stream.hpp>
+#include <io/settings.hpp>
+
+namespace io {
+
+// Reads rows of every file of a dataset (a parquet file or a directory of
+// parquet part files) one file after another. The next file is opened and
+// its first row groups are decoded in the background while the current one
+// is read.
+template <class T> class DatasetIStream {
+public:
+  using type = T;
+
+  DatasetIStream() = default;
+
+  DatasetIStream(const std::string &path, const ParquetSettings &settings)
+      : DatasetIStream(path, settings, std::nullopt) {}
+
+  DatasetIStream(const std::string &path, const ParquetSettings &settings,
+                 std::optional<RangePredicate> predicate)
+      : files_(ListInputFiles(path)),
+        settings_(std::make_shared<ParquetSettings>(settings)),
+        predicate_(std::move(predicate)) {
+    OpenNext();
+    Advance();
+  }
+
+  DatasetIStream(const DatasetIStream &) = delete;
+  DatasetIStream(DatasetIStream &&) = default;
+  DatasetIStream &operator=(DatasetIStream &&) = default;
+
+  bool Eof() const { return current_.Eof(); }
+
+  DatasetIStream &operator>>(T &row) {
+    Release();
+    current_ >> row;
+
+    if (current_.Eof()) {
+      Advance();
+    }
+
+    return *this;
+  }
+
+  // Reads up to `count` rows, returns the number of rows read
+  size_t Read(T *rows, size_t count) {
+    Release();
+    size_t read = 0;
+
+    while (read != count && !Eof()) {
+      read += current_.Read(rows + read, count - read);
+
+      if (current_.Eof()) {
+        Advance();
+      }
+    }
+
+    return read;
+  }
+
+private:
+  void OpenNext() {
+    if (next_file_ == files_.size()) {
+      return;
+    }
+
+    next_ = std::async(std::launch::async,
+                       [filename = files_[next_file_], settings = settings_,
+                        predicate = predicate_] {
+                         return BatchIStream<T>(filename, *settings,
+                                                predicate);
+                       });
+    ++next_file_;
+  }
+
+  // Files whose last rows may still be viewed are closed on the next read
+  void Release() {
+    if constexpr (ArenaBacked<T>) {
+      finished_.clear();
+    }
+  }
+
+  // Moves on to the next non empty file
+  void Advance() {
+    while (current_.Eof() && next_.valid()) {
+      if constexpr (ArenaBacked<T>) {
+        finished_.push_back(std::move(current_));
+      }
+      current_ = next_.get();
+      OpenNext();
+    }
+  }
+
+private:
+  std::vector<std::string> files_;
+  size_t next_file_ = 0;
+  std::shared_ptr<const ParquetSettings> settings_;
+  std::optional<RangePredicate> predicate_;
+
+  BatchIStream<T> current_;
+  std::future<BatchIStream<T>> next_;
+  std::vector<BatchIStream<T>> finished_;
+};
+
+} // namespace io
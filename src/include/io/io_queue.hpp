@@ -0,0 +1,101 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace io {
+
+// Runs blocking reads of one device on threads of its own, streams whose
+// files live on different devices are served concurrently
+class IoQueue {
+public:
+  explicit IoQueue(size_t threads) {
+    for (size_t ind = 0; ind != threads; ++ind) {
+      workers_.emplace_back([this] { Run(); });
+    }
+  }
+
+  IoQueue(const IoQueue &) = delete;
+
+  ~IoQueue() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    ready_.notify_all();
+
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+  }
+
+  template <class F> auto Submit(F task) {
+    using R = std::invoke_result_t<F>;
+
+    auto packaged = std::make_shared<std::packaged_task<R()>>(std::move(task));
+    auto result = packaged->get_future();
+    {
+      std::lock_guard lock(mutex_);
+      tasks_.emplace_back([packaged] { (*packaged)(); });
+    }
+    ready_.notify_one();
+
+    return result;
+  }
+
+private:
+  void Run() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock lock(mutex_);
+        ready_.wait(lock, [&] { return stop_ || !tasks_.empty(); });
+        if (tasks_.empty()) {
+          return;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<std::function<void()>> tasks_;
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+};
+
+// Queue of the device `path` is stored on, two requests per device are kept
+// in flight
+inline IoQueue &DeviceQueue(const std::string &path) {
+  static constexpr size_t kThreadsPerDevice = 2;
+
+  static std::mutex mutex;
+  static std::map<dev_t, std::unique_ptr<IoQueue>> queues;
+
+  struct stat st {};
+  stat(path.c_str(), &st);
+
+  std::lock_guard lock(mutex);
+  auto &queue = queues[st.st_dev];
+  if (!queue) {
+    queue = std::make_unique<IoQueue>(kThreadsPerDevice);
+  }
+  return *queue;
+}
+
+} // namespace io
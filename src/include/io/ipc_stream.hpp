@@ -0,0 +1,190 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/api.h>
+#include <parquet/exception.h>
+
+#include <io/settings.hpp>
+
+namespace io {
+
+// Reads rows from a memory mapped Arrow IPC file, batches reference the
+// mapping directly so no column data is copied or decoded
+template <class T> class IpcIStream {
+public:
+  using type = T;
+
+  IpcIStream() = default;
+
+  IpcIStream(const std::string &filename, const BufferSettings &) {
+    PARQUET_ASSIGN_OR_THROW(
+        file_,
+        arrow::io::MemoryMappedFile::Open(filename, arrow::io::FileMode::READ));
+    PARQUET_ASSIGN_OR_THROW(reader_,
+                            arrow::ipc::RecordBatchFileReader::Open(file_));
+
+    Fetch();
+  }
+
+  IpcIStream(const IpcIStream &) = delete;
+  IpcIStream(IpcIStream &&) = default;
+  IpcIStream &operator=(IpcIStream &&) = default;
+
+  bool Eof() const { return !batch_; }
+
+  IpcIStream &operator>>(T &row) {
+    array_.Read(row, last_row_);
+    ++last_row_;
+
+    if (batch_->num_rows() == last_row_) {
+      Fetch();
+    }
+
+    return *this;
+  }
+
+  // Reads up to `count` rows, returns the number of rows read
+  size_t Read(T *rows, size_t count) {
+    size_t read = 0;
+
+    while (read != count && !Eof()) {
+      const size_t step =
+          std::min<size_t>(count - read, batch_->num_rows() - last_row_);
+      array_.ReadRange(rows + read, last_row_, step);
+      read += step;
+      last_row_ += step;
+
+      if (batch_->num_rows() == last_row_) {
+        Fetch();
+      }
+    }
+
+    return read;
+  }
+
+private:
+  void Fetch() {
+    last_row_ = 0;
+    batch_.reset();
+
+    while (!batch_ && next_batch_ != reader_->num_record_batches()) {
+      PARQUET_ASSIGN_OR_THROW(batch_, reader_->ReadRecordBatch(next_batch_));
+      ++next_batch_;
+
+      if (batch_->num_rows() == 0) {
+        batch_.reset();
+      }
+    }
+
+    if (batch_) {
+      array_ = {*batch_};
+    }
+  }
+
+private:
+  std::shared_ptr<arrow::io::MemoryMappedFile> file_;
+  std::shared_ptr<arrow::ipc::RecordBatchFileReader> reader_;
+  int next_batch_ = 0;
+
+  std::shared_ptr<arrow::RecordBatch> batch_;
+  int64_t last_row_ = 0;
+
+  typename T::BatchArray array_;
+};
+
+template <class T> class IpcOStream {
+public:
+  using type = T;
+
+  IpcOStream() = default;
+
+  IpcOStream(const std::string &filename, const BufferSettings &settings)
+      : builder_(settings.batch_rows) {
+    PARQUET_ASSIGN_OR_THROW(outfile_,
+                            arrow::io::FileOutputStream::Open(filename));
+    PARQUET_ASSIGN_OR_THROW(writer_,
+                            arrow::ipc::MakeFileWriter(outfile_, T::kSchema));
+  }
+
+  IpcOStream(const IpcOStream &) = delete;
+  IpcOStream(IpcOStream &&) = default;
+  IpcOStream &operator=(IpcOStream &&ostream) {
+    std::destroy_at(this);
+    std::construct_at(this, std::move(ostream));
+    return *this;
+  }
+
+  // Errors of a stream that was not closed can only be logged, a destructor
+  // that throws during unwinding terminates the process
+  ~IpcOStream() {
+    arrow::Status status;
+    try {
+      status = Close();
+    } catch (const std::exception &error) {
+      status = arrow::Status::UnknownError(error.what());
+    }
+    if (!status.ok()) {
+      std::cerr << "IpcOStream: " << status.ToString() << std::endl;
+    }
+  }
+
+  // Writes the remaining rows and the footer, reports the first error. The
+  // stream is unusable afterwards.
+  arrow::Status Close() {
+    if (!writer_) {
+      return arrow::Status::OK();
+    }
+
+    arrow::Status status;
+    if (builder_.Size()) {
+      status = writer_->WriteRecordBatch(*builder_.Finish());
+    }
+    if (status.ok()) {
+      status = writer_->Close();
+    }
+    writer_.reset();
+    if (status.ok()) {
+      status = outfile_->Close();
+    }
+    return status;
+  }
+
+  IpcOStream &operator<<(const T &row) {
+    builder_.Append(row);
+
+    if (builder_.Full()) {
+      Flush();
+    }
+
+    return *this;
+  }
+
+  void Write(const T *rows, size_t count) {
+    while (count) {
+      const size_t step = std::min(count, builder_.Capacity() - builder_.Size());
+      builder_.Append(rows, step);
+      rows += step;
+      count -= step;
+
+      if (builder_.Full()) {
+        Flush();
+      }
+    }
+  }
+
+private:
+  void Flush() {
+    PARQUET_THROW_NOT_OK(writer_->WriteRecordBatch(*builder_.Finish()));
+  }
+
+private:
+  std::shared_ptr<arrow::io::FileOutputStream> outfile_;
+  std::shared_ptr<arrow::ipc::RecordBatchWriter> writer_;
+  typename T::BatchBuilder builder_;
+};
+
+} // namespace io
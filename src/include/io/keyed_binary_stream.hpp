@@ -0,0 +1,128 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <type_traits>
+
+#include <io/arena.hpp>
+#include <io/binary_serializer.hpp>
+#include <io/binary_stream.hpp>
+#include <io/settings.hpp>
+
+namespace io {
+
+// Spill records of KeyedBinary streams: sort key, payload size, serialized
+// row. Merges and bucket splits route records by the key alone and copy the
+// payload as opaque bytes, rows are deserialized only when they leave the
+// spill format.
+template <class Key>
+constexpr size_t kKeyedHeaderSize = sizeof(Key) + sizeof(size_t);
+
+template <class T, class KeyF> class KeyedBinaryOStream {
+public:
+  using type = T;
+  using key_type = std::invoke_result_t<KeyF, const T &>;
+
+  KeyedBinaryOStream() = default;
+
+  KeyedBinaryOStream(const std::string &filename,
+                     const BufferSettings &settings, KeyF key)
+      : key_(key), writer_(filename, settings) {}
+
+  // See SpillWriter::Close
+  arrow::Status Close() { return writer_.Close(); }
+
+  KeyedBinaryOStream &operator<<(const T &row) {
+    const size_t size = row.SerializedSize();
+
+    char *dst = Header(std::invoke(key_, row), size);
+    row.Serialize(dst);
+    writer_.Commit(kKeyedHeaderSize<key_type> + size);
+
+    return *this;
+  }
+
+  // Writes a record whose row is already serialized
+  void Append(key_type key, const char *payload, size_t size) {
+    std::memcpy(Header(key, size), payload, size);
+    writer_.Commit(kKeyedHeaderSize<key_type> + size);
+  }
+
+private:
+  char *Header(key_type key, size_t size) {
+    char *dst = writer_.Reserve(kKeyedHeaderSize<key_type> + size);
+    io::SerializeValue(dst, key);
+    io::SerializeValue(dst, size);
+    return dst;
+  }
+
+private:
+  KeyF key_;
+  details::SpillWriter writer_;
+};
+
+template <class T, class KeyF> class KeyedBinaryIStream {
+public:
+  using type = T;
+  using key_type = std::invoke_result_t<KeyF, const T &>;
+
+  KeyedBinaryIStream() = default;
+
+  KeyedBinaryIStream(const std::string &filename,
+                     const BufferSettings &settings)
+      : reader_(filename, settings, ArenaBacked<T>) {
+    Load();
+  }
+
+  bool Eof() const { return reader_.Eof(); }
+
+  // Key of the next record
+  key_type Key() const { return key_; }
+
+  KeyedBinaryIStream &operator>>(T &row) {
+    row.Deserialize(reader_.Data() + kKeyedHeaderSize<key_type>);
+    Next();
+    return *this;
+  }
+
+  // Moves the next record to `output`, as raw bytes if it is a keyed stream
+  template <class O> void Emit(O &output) {
+    char *payload = reader_.Data() + kKeyedHeaderSize<key_type>;
+
+    if constexpr (requires { output.Append(key_, payload, size_); }) {
+      output.Append(key_, payload, size_);
+    } else {
+      T row;
+      row.Deserialize(payload);
+      output << row;
+    }
+
+    Next();
+  }
+
+private:
+  void Next() {
+    reader_.Skip(kKeyedHeaderSize<key_type> + size_);
+    Load();
+  }
+
+  // Parses the header of the next record and makes the whole record
+  // contiguous in the buffer
+  void Load() {
+    if (reader_.Eof()) {
+      return;
+    }
+
+    char *src = reader_.Need(kKeyedHeaderSize<key_type>);
+    key_ = io::DeserializeValue<key_type>(src);
+    size_ = io::DeserializeValue<size_t>(src);
+    reader_.Need(kKeyedHeaderSize<key_type> + size_);
+  }
+
+private:
+  details::SpillReader reader_;
+  key_type key_{};
+  size_t size_ = 0;
+};
+
+} // namespace io
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <parquet/exception.h>
+#include <parquet/file_reader.h>
+#include <parquet/file_writer.h>
+#include <parquet/metadata.h>
+#include <parquet/properties.h>
+
+#include <io/literals.hpp>
+
+namespace io {
+
+namespace details {
+
+inline const std::string kParquetMagic = "PAR1";
+
+// Copies `size` bytes at `offset` of `input` to the end of `output`
+inline arrow::Status CopyRange(arrow::io::RandomAccessFile &input,
+                               int64_t offset, int64_t size,
+                               arrow::io::OutputStream &output) {
+  static constexpr int64_t kCopyBlock = 8_MiB;
+
+  while (size) {
+    const int64_t step = std::min(size, kCopyBlock);
+    ARROW_ASSIGN_OR_RAISE(auto buffer, input.ReadAt(offset, step));
+    ARROW_RETURN_NOT_OK(output.Write(buffer));
+    offset += step;
+    size -= step;
+  }
+
+  return arrow::Status::OK();
+}
+
+// Adds the metadata of `chunk`, whose bytes were moved by `shift`, to the
+// row group being built
+inline void AppendColumnChunk(const parquet::ColumnChunkMetaData &chunk,
+                              int64_t shift,
+                              parquet::ColumnChunkMetaDataBuilder &builder) {
+  if (const auto stats = chunk.encoded_statistics()) {
+    builder.SetStatistics(*stats);
+  }
+
+  std::map<parquet::Encoding::type, int32_t> dict_encodings;
+  std::map<parquet::Encoding::type, int32_t> data_encodings;
+  for (const auto &stats : chunk.encoding_stats()) {
+    auto &encodings = stats.page_type == parquet::PageType::DICTIONARY_PAGE
+                          ? dict_encodings
+                          : data_encodings;
+    encodings[stats.encoding] += stats.count;
+  }
+  if (chunk.encoding_stats().empty()) {
+    for (const auto encoding : chunk.encodings()) {
+      data_encodings[encoding] = 1;
+    }
+  }
+
+  builder.Finish(
+      chunk.num_values(),
+      chunk.has_dictionary_page() ? chunk.dictionary_page_offset() + shift : 0,
+      0, chunk.data_page_offset() + shift, chunk.total_compressed_size(),
+      chunk.total_uncompressed_size(), chunk.has_dictionary_page(), false,
+      dict_encodings, data_encodings);
+}
+
+// Whether `lhs` and `rhs` name the same file
+inline bool SameFile(const std::string &lhs, const std::string &rhs) {
+  std::error_code error;
+  return lhs == rhs || std::filesystem::equivalent(lhs, rhs, error);
+}
+
+// Bytes of the footer of a file with `metadata`: the metadata, its length
+// and the magic
+inline int64_t FooterSize(const parquet::FileMetaData &metadata) {
+  return metadata.size() + 2 * sizeof(uint32_t);
+}
+
+} // namespace details
+
+// Concatenates parquet files of the same schema into `output` by copying
+// their column chunks verbatim and writing a footer with shifted offsets, no
+// page is decoded or re-encoded. If `output` is the first input, the file is
+// extended in place and only the other inputs are copied; should that fail,
+// its own footer is written back. `output` may not be any other input. Page
+// indexes and bloom filters of the inputs are not carried over.
+inline arrow::Status StitchParquet(const std::vector<std::string> &inputs,
+                                   const std::string &output) {
+  if (inputs.empty()) {
+    return arrow::Status::Invalid("Nothing to stitch into ", output);
+  }
+  for (size_t ind = 1; ind != inputs.size(); ++ind) {
+    if (details::SameFile(output, inputs[ind])) {
+      return arrow::Status::Invalid("Output ", output,
+                                    " is an input other than the first");
+    }
+  }
+
+  BEGIN_PARQUET_CATCH_EXCEPTIONS
+
+  // every input is opened and checked before the first one is touched
+  std::vector<std::shared_ptr<arrow::io::RandomAccessFile>> files;
+  std::vector<std::shared_ptr<parquet::FileMetaData>> metadata;
+  for (const auto &input : inputs) {
+    ARROW_ASSIGN_OR_RAISE(files.emplace_back(),
+                          arrow::io::ReadableFile::Open(input));
+    metadata.push_back(parquet::ReadMetaData(files.back()));
+
+    if (!metadata.back()->schema()->Equals(*metadata.front()->schema())) {
+      return arrow::Status::Invalid("Schema of ", input, " differs from ",
+                                    inputs.front());
+    }
+
+    ARROW_ASSIGN_OR_RAISE(const int64_t size, files.back()->GetSize());
+    for (int row_group = 0; row_group != metadata.back()->num_row_groups();
+         ++row_group) {
+      const auto source = metadata.back()->RowGroup(row_group);
+      for (int column = 0; column != source->num_columns(); ++column) {
+        const auto chunk = source->ColumnChunk(column);
+        const int64_t begin = chunk->has_dictionary_page()
+                                  ? chunk->dictionary_page_offset()
+                                  : chunk->data_page_offset();
+        if (begin < 0 || begin + chunk->total_compressed_size() > size) {
+          return arrow::Status::Invalid("Column chunk of ", input,
+                                        " lies outside of the file");
+        }
+      }
+    }
+  }
+
+  const bool in_place = details::SameFile(output, inputs.front());
+
+  std::shared_ptr<arrow::io::FileOutputStream> outfile;
+  int64_t position;
+  if (in_place) {
+    // drop the footer, the column chunks of the first file stay where they
+    // are
+    files.front().reset();
+    position = std::filesystem::file_size(output) -
+               details::FooterSize(*metadata.front());
+    std::filesystem::resize_file(output, position);
+    ARROW_ASSIGN_OR_RAISE(outfile,
+                          arrow::io::FileOutputStream::Open(output, true));
+  } else {
+    ARROW_ASSIGN_OR_RAISE(outfile, arrow::io::FileOutputStream::Open(output));
+    ARROW_RETURN_NOT_OK(outfile->Write(details::kParquetMagic));
+    position = details::kParquetMagic.size();
+  }
+  const int64_t data_end = position;
+
+  const auto stitch = [&]() -> arrow::Status {
+    BEGIN_PARQUET_CATCH_EXCEPTIONS
+
+    const auto props = parquet::default_writer_properties();
+    auto builder =
+        parquet::FileMetaDataBuilder::Make(metadata.front()->schema(), props);
+
+    for (size_t ind = 0; ind != inputs.size(); ++ind) {
+      const bool copy = !in_place || ind != 0;
+
+      for (int row_group = 0; row_group != metadata[ind]->num_row_groups();
+           ++row_group) {
+        const auto source = metadata[ind]->RowGroup(row_group);
+        auto *row_group_builder = builder->AppendRowGroup();
+        row_group_builder->set_num_rows(source->num_rows());
+
+        for (int column = 0; column != source->num_columns(); ++column) {
+          const auto chunk = source->ColumnChunk(column);
+          const int64_t begin = chunk->has_dictionary_page()
+                                    ? chunk->dictionary_page_offset()
+                                    : chunk->data_page_offset();
+
+          int64_t shift = 0;
+          if (copy) {
+            shift = position - begin;
+            ARROW_RETURN_NOT_OK(details::CopyRange(
+                *files[ind], begin, chunk->total_compressed_size(), *outfile));
+            position += chunk->total_compressed_size();
+          }
+
+          details::AppendColumnChunk(*chunk, shift,
+                                     *row_group_builder->NextColumnChunk());
+        }
+
+        row_group_builder->Finish(source->total_byte_size());
+      }
+    }
+
+    const auto stitched =
+        builder->Finish(metadata.front()->key_value_metadata());
+    parquet::WriteFileMetaData(*stitched, outfile.get());
+    return outfile->Close();
+
+    END_PARQUET_CATCH_EXCEPTIONS
+  };
+
+  const arrow::Status status = stitch();
+  if (!status.ok() && in_place) {
+    // the first input gets its own footer back
+    (void)outfile->Close();
+    std::filesystem::resize_file(output, data_end);
+    ARROW_ASSIGN_OR_RAISE(outfile,
+                          arrow::io::FileOutputStream::Open(output, true));
+    parquet::WriteFileMetaData(*metadata.front(), outfile.get());
+    ARROW_RETURN_NOT_OK(outfile->Close());
+  }
+  ARROW_RETURN_NOT_OK(status);
+
+  END_PARQUET_CATCH_EXCEPTIONS
+
+  return arrow::Status::OK();
+}
+
+} // namespace io
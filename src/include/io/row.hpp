@@ -1,13 +1,17 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <fstream>
 #include <memory>
+#include <string_view>
 #include <tuple>
+#include <type_traits>
 
 #include <parquet/stream_reader.h>
 #include <parquet/stream_writer.h>
 
+#include <io/arena.hpp>
 #include <io/binary_serializer.hpp>
 #include <models/type_traits.hpp>
 
@@ -28,6 +32,10 @@ namespace io {
 template <class... Fields> struct Row : public Fields... {
   static_assert(sizeof...(Fields));
 
+  // rows per column pass of bulk conversions, keeps the block in L2
+  static constexpr size_t kBlockRows =
+      std::max<size_t>(64, (256ul << 10) / (sizeof(Fields) + ... + 0));
+
   static inline const std::shared_ptr<arrow::Schema> kSchema = arrow::schema(
       {arrow::field(Fields::kName,
                     models::TypeTraits<typename Fields::type>::field_type)...});
@@ -44,6 +52,18 @@ template <class... Fields> struct Row : public Fields... {
     io::Deserialize<Fields::kField...>(src, *this);
   }
 
+  // Copies the bytes of string_view fields into `arena`, so the row outlives
+  // the buffer or batch it was read from
+  void Store(Arena &arena)
+    requires(... || std::is_same_v<typename Fields::type, std::string_view>)
+  {
+    (..., [&] {
+      if constexpr (std::is_same_v<typename Fields::type, std::string_view>) {
+        this->*Fields::kField = arena.Store(this->*Fields::kField);
+      }
+    }());
+  }
+
   class BatchBuilder {
   public:
     BatchBuilder() = default;
@@ -53,6 +73,15 @@ template <class... Fields> struct Row : public Fields... {
       Append(row, std::make_index_sequence<sizeof...(Fields)>{});
     }
 
+    // Appends column by column over cache-sized blocks of rows, `count` must
+    // fit into the remaining capacity
+    void Append(const Row *rows, size_t count) {
+      for (size_t from = 0; from < count; from += kBlockRows) {
+        Append(rows + from, std::min(kBlockRows, count - from),
+               std::make_index_sequence<sizeof...(Fields)>{});
+      }
+    }
+
     size_t Size() const { return std::get<0>(builders_).length(); }
     size_t Capacity() const { return size_; }
     size_t Full() const { return Size() == Capacity(); }
@@ -81,6 +110,32 @@ template <class... Fields> struct Row : public Fields... {
       }());
     }
 
+    template <size_t... Is>
+    void Append(const Row *rows, size_t count, std::index_sequence<Is...>) {
+      (..., AppendColumn<Fields>(std::get<Is>(builders_), rows, count));
+    }
+
+    template <class Field>
+    static void AppendColumn(models::BuilderT<typename Field::type> &builder,
+                             const Row *rows, size_t count) {
+      if constexpr (std::is_arithmetic_v<typename Field::type>) {
+        PARQUET_THROW_NOT_OK(builder.Reserve(count));
+        for (size_t ind = 0; ind != count; ++ind) {
+          builder.UnsafeAppend(rows[ind].*Field::kField);
+        }
+      } else {
+        size_t data_size = 0;
+        for (size_t ind = 0; ind != count; ++ind) {
+          data_size += std::size(rows[ind].*Field::kField);
+        }
+        PARQUET_THROW_NOT_OK(builder.Reserve(count));
+        PARQUET_THROW_NOT_OK(builder.ReserveData(data_size));
+        for (size_t ind = 0; ind != count; ++ind) {
+          builder.UnsafeAppend(rows[ind].*Field::kField);
+        }
+      }
+    }
+
     template <size_t I>
     void Finish(std::vector<std::shared_ptr<arrow::Array>> &arrays) {
       if constexpr (I) {
@@ -106,6 +161,16 @@ template <class... Fields> struct Row : public Fields... {
       return Read(row, ind, std::make_index_sequence<sizeof...(Fields)>{});
     }
 
+    // Transposes rows [first, first + count) into `out` column by column
+    // over cache-sized blocks of rows, fixed width columns are read straight
+    // from their value buffers
+    void ReadRange(Row *out, size_t first, size_t count) {
+      for (size_t from = 0; from < count; from += kBlockRows) {
+        ReadRange(out + from, first + from, std::min(kBlockRows, count - from),
+                  std::make_index_sequence<sizeof...(Fields)>{});
+      }
+    }
+
   private:
     template <size_t... Is>
     void Unpack(const arrow::RecordBatch &batch, std::index_sequence<Is...>) {
@@ -120,6 +185,28 @@ template <class... Fields> struct Row : public Fields... {
                  std::get<Is>(array_ptrs_)->Value(ind))}));
     }
 
+    template <size_t... Is>
+    void ReadRange(Row *out, size_t first, size_t count,
+                   std::index_sequence<Is...>) {
+      (..., ReadColumn<Fields>(*std::get<Is>(array_ptrs_), out, first, count));
+    }
+
+    template <class Field>
+    static void ReadColumn(const models::ArrayT<typename Field::type> &array,
+                           Row *out, size_t first, size_t count) {
+      if constexpr (std::is_arithmetic_v<typename Field::type>) {
+        const auto *values = array.raw_values() + first;
+        for (size_t ind = 0; ind != count; ++ind) {
+          out[ind].*Field::kField = values[ind];
+        }
+      } else {
+        for (size_t ind = 0; ind != count; ++ind) {
+          out[ind].*Field::kField =
+              typename Field::type(array.GetView(first + ind));
+        }
+      }
+    }
+
   private:
     std::tuple<models::ArrayT<typename Fields::type> *...> array_ptrs_;
   };
@@ -1,30 +1,183 @@
 #pragma once
 
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include <optional>
+#include <string>
+#include <vector>
+
 #include <arrow/api.h>
 #include <arrow/io/file.h>
+#include <arrow/ipc/api.h>
+#include <arrow/util/compression.h>
 #include <parquet/arrow/reader.h>
 #include <parquet/arrow/schema.h>
+#include <parquet/properties.h>
 
+#include <io/buffer_pool.hpp>
 #include <io/literals.hpp>
 
 namespace io {
 
+// Keeps rows whose `column` value lies in [min, max]
+struct RangePredicate {
+  std::string column;
+  uint64_t min = 0;
+  uint64_t max = std::numeric_limits<uint64_t>::max();
+};
+
+// Layout of the final (sorted) output file, spill runs are unaffected
+struct OutputOptions {
+  // column the output is sorted by, recorded as sorting_columns
+  std::optional<std::string> sorted_by;
+  // DELTA_BINARY_PACKED for the sorted_by column, small for ordered integers
+  bool delta_key = false;
+  // column and offset indexes, lets readers pick pages within a row group
+  bool page_index = false;
+  parquet::Compression::type compression = parquet::Compression::UNCOMPRESSED;
+};
+
+// Adds `output` to a writer of files with `schema`
+inline void ApplyOutputOptions(const OutputOptions &output,
+                               const parquet::SchemaDescriptor &schema,
+                               parquet::WriterProperties::Builder &builder) {
+  builder.compression(output.compression);
+
+  if (output.page_index) {
+    builder.enable_write_page_index();
+  }
+
+  if (output.sorted_by) {
+    const int column = schema.ColumnIndex(*output.sorted_by);
+    if (column < 0) {
+      throw parquet::ParquetException("No column " + *output.sorted_by +
+                                      " in output");
+    }
+
+    builder.set_sorting_columns({parquet::SortingColumn{column, false, false}});
+    if (output.delta_key) {
+      builder.encoding(*output.sorted_by,
+                       parquet::Encoding::DELTA_BINARY_PACKED);
+    }
+  }
+}
+
+// Writer properties of output files with `schema`, the sorted_by column of
+// `output` is looked up in it
+inline std::shared_ptr<parquet::WriterProperties>
+MakeWriterProps(size_t batch_rows, const OutputOptions &output,
+                const arrow::Schema &schema) {
+  parquet::WriterProperties::Builder builder;
+  builder.compression(parquet::Compression::UNCOMPRESSED)
+      ->encoding(parquet::Encoding::PLAIN)
+      ->write_batch_size(batch_rows)
+      ->max_row_group_length(batch_rows)
+      ->disable_dictionary();
+
+  std::shared_ptr<parquet::SchemaDescriptor> schema_descriptor;
+  PARQUET_THROW_NOT_OK(parquet::arrow::ToParquetSchema(
+      &schema, *builder.build(), &schema_descriptor));
+  ApplyOutputOptions(output, *schema_descriptor, builder);
+
+  return builder.build();
+}
+
+// Block compression of spill runs written by BinaryOStream
+struct SpillOptions {
+  arrow::Compression::type codec = arrow::Compression::UNCOMPRESSED;
+  int level = arrow::util::kUseDefaultCompressionLevel;
+  // spill runs are read ahead on the I/O queue of their device while the
+  // current buffer is parsed, costs another buffer per open run
+  bool read_ahead = false;
+};
+
 struct BufferSettings {
-  BufferSettings(size_t total_rows, size_t batches_num, size_t row_width)
+  BufferSettings(size_t total_rows, size_t batches_num, size_t row_width,
+                 const SpillOptions &spill = {})
       : total_rows(total_rows), batches_num(batches_num),
         batch_rows(total_rows / batches_num),
-        buffer_size(batch_rows * row_width) {}
+        buffer_size(batch_rows * row_width), spill(spill) {}
 
 public:
   const size_t total_rows;
   const size_t batches_num;
   const size_t batch_rows;
   const size_t buffer_size;
+  const SpillOptions spill;
+  // buffers of spill streams come from here if set, the heap otherwise
+  BufferPool *pool = nullptr;
 };
 
+// Files of a dataset: the file itself, or the non hidden regular files of a
+// directory in name order
+inline std::vector<std::string> ListInputFiles(const std::string &path) {
+  if (!std::filesystem::is_directory(path)) {
+    return {path};
+  }
+
+  std::vector<std::string> files;
+  for (const auto &entry : std::filesystem::directory_iterator(path)) {
+    const auto name = entry.path().filename().string();
+    if (entry.is_regular_file() && name.front() != '.' &&
+        name.front() != '_') {
+      files.push_back(entry.path().string());
+    }
+  }
+  std::sort(files.begin(), files.end());
+
+  return files;
+}
+
+// Output file for `path`, a directory (existing or ending with a separator)
+// gets a single part file inside it
+inline std::string OutputFile(const std::string &path) {
+  if (!path.ends_with('/') && !std::filesystem::is_directory(path)) {
+    return path;
+  }
+
+  std::filesystem::create_directories(path);
+  return (std::filesystem::path(path) / "part-0.parquet").string();
+}
+
+// Schema of a parquet or an Arrow IPC file, or of the first file of a
+// dataset directory
+inline std::shared_ptr<arrow::Schema> ReadSchema(const std::string &path) {
+  static const std::string kIpcMagic = "ARROW1";
+
+  const auto files = ListInputFiles(path);
+  if (files.empty()) {
+    throw parquet::ParquetException("no input files in " + path);
+  }
+  const std::string &filename = files.front();
+
+  std::shared_ptr<arrow::io::RandomAccessFile> infile;
+  PARQUET_ASSIGN_OR_THROW(infile, arrow::io::ReadableFile::Open(filename));
+
+  std::shared_ptr<arrow::Buffer> magic;
+  PARQUET_ASSIGN_OR_THROW(magic, infile->ReadAt(0, kIpcMagic.size()));
+
+  std::shared_ptr<arrow::Schema> schema;
+  if (magic->ToString() == kIpcMagic) {
+    std::shared_ptr<arrow::ipc::RecordBatchFileReader> ipc_reader;
+    PARQUET_ASSIGN_OR_THROW(ipc_reader,
+                            arrow::ipc::RecordBatchFileReader::Open(infile));
+    schema = ipc_reader->schema();
+  } else {
+    std::unique_ptr<parquet::arrow::FileReader> arrow_reader;
+    PARQUET_THROW_NOT_OK(parquet::arrow::OpenFile(
+        infile, arrow::default_memory_pool(), &arrow_reader));
+    PARQUET_THROW_NOT_OK(arrow_reader->GetSchema(&schema));
+  }
+
+  return schema;
+}
+
 struct ParquetSettings {
   ParquetSettings(size_t buffer_size, size_t batch_rows,
-                  const std::string &input_filename) {
+                  const std::string &input_filename,
+                  const OutputOptions &output = {})
+      : output(output) {
     auto reader_props = parquet::ReaderProperties(arrow::default_memory_pool());
     reader_props.enable_buffered_stream();
     reader_props.set_buffer_size(buffer_size);
@@ -32,31 +185,19 @@ struct ParquetSettings {
     parquet::ArrowReaderProperties arrow_reader_props;
     arrow_reader_props.set_batch_size(batch_rows);
 
-    std::shared_ptr<parquet::WriterProperties> writer_props =
-        parquet::WriterProperties::Builder()
-            .compression(parquet::Compression::UNCOMPRESSED)
-            ->encoding(parquet::Encoding::PLAIN)
-            ->write_batch_size(batch_rows)
-            ->max_row_group_length(batch_rows)
-            ->disable_dictionary()
-            ->build();
-
-    auto arrow_writer_props =
-        parquet::ArrowWriterProperties::Builder().store_schema()->build();
+    auto arrow_writer_props = parquet::ArrowWriterProperties::Builder()
+                                  .store_schema()
+                                  ->set_use_threads(true)
+                                  ->build();
 
+    const std::shared_ptr<arrow::Schema> arrow_schema =
+        ReadSchema(input_filename);
     std::shared_ptr<parquet::SchemaDescriptor> schema_descriptor;
     std::shared_ptr<parquet::schema::GroupNode> schema;
     {
-      std::unique_ptr<parquet::arrow::FileReader> arrow_reader;
-      std::shared_ptr<arrow::io::RandomAccessFile> infile;
-      PARQUET_ASSIGN_OR_THROW(infile,
-                              arrow::io::ReadableFile::Open(input_filename));
-      PARQUET_THROW_NOT_OK(parquet::arrow::OpenFile(
-          infile, arrow::default_memory_pool(), &arrow_reader));
-      std::shared_ptr<arrow::Schema> arrow_schema;
-      PARQUET_THROW_NOT_OK(arrow_reader->GetSchema(&arrow_schema));
       PARQUET_THROW_NOT_OK(parquet::arrow::ToParquetSchema(
-          arrow_schema.get(), *writer_props, &schema_descriptor));
+          arrow_schema.get(), *parquet::default_writer_properties(),
+          &schema_descriptor));
 
       // nasty trick, TODO: find better solution
       schema = std::shared_ptr<parquet::schema::GroupNode>(
@@ -65,6 +206,10 @@ struct ParquetSettings {
           [](void *) {});
     }
 
+    // ParquetOStream writes files with the schema of the input
+    std::shared_ptr<parquet::WriterProperties> writer_props =
+        MakeWriterProps(batch_rows, output, *arrow_schema);
+
     const_cast<parquet::ReaderProperties &>(this->reader_props) =
         std::move(reader_props);
     const_cast<parquet::ArrowReaderProperties &>(this->arrow_reader_props) =
@@ -79,21 +224,39 @@ struct ParquetSettings {
         std::move(schema);
   }
 
+  // Writer properties for files with `schema` rather than the schema of the
+  // input, e.g. the projection BatchOStream writes
+  std::shared_ptr<parquet::WriterProperties>
+  WriterProps(const arrow::Schema &schema) const {
+    return MakeWriterProps(writer_props->write_batch_size(), output, schema);
+  }
+
 public:
+  const OutputOptions output;
   const parquet::ReaderProperties reader_props;
   const parquet::ArrowReaderProperties arrow_reader_props;
   const std::shared_ptr<parquet::WriterProperties> writer_props;
   const std::shared_ptr<parquet::ArrowWriterProperties> arrow_writer_props;
   const std::shared_ptr<parquet::SchemaDescriptor> schema_descriptor;
   const std::shared_ptr<parquet::schema::GroupNode> schema;
+  // allocations of the Arrow readers and writers of batch streams
+  arrow::MemoryPool *memory_pool = arrow::default_memory_pool();
 };
 
 struct Settings : public BufferSettings, public ParquetSettings {
   Settings(size_t total_rows, size_t batches_num, size_t row_width,
-           const std::string &input_filename)
-      : BufferSettings(total_rows, batches_num, row_width),
+           const std::string &input_filename, const OutputOptions &output = {},
+           const SpillOptions &spill = {})
+      : BufferSettings(total_rows, batches_num, row_width, spill),
         ParquetSettings(BufferSettings::buffer_size, BufferSettings::batch_rows,
-                        input_filename) {}
+                        input_filename, output) {}
+
+  // Spill buffers and Arrow allocations both come from `budget`, the memory
+  // manager of the job, if set
+  void Use(BufferPool *budget) {
+    pool = budget;
+    memory_pool = budget ? budget : arrow::default_memory_pool();
+  }
 };
 
 } // namespace io
@@ -4,6 +4,9 @@
 
 #include <io/batch_stream.hpp>
 #include <io/binary_stream.hpp>
+#include <io/dataset_stream.hpp>
+#include <io/ipc_stream.hpp>
+#include <io/keyed_binary_stream.hpp>
 #include <io/parquet_stream.hpp>
 
 namespace models {
@@ -23,6 +26,17 @@ template <class T> struct BatchStreams {
   using output = io::BatchOStream<T>;
 };
 
+template <class T> struct IpcStreams {
+  using input = io::IpcIStream<T>;
+  using output = io::IpcOStream<T>;
+};
+
+// Spill runs of key-prefixed records, see KeyedBinaryIStream
+template <class T, class KeyF> struct KeyedBinaryStreams {
+  using input = io::KeyedBinaryIStream<T, KeyF>;
+  using output = io::KeyedBinaryOStream<T, KeyF>;
+};
+
 template <class T>
 concept IStream = requires(T a) {
   typename T::type;
@@ -38,6 +52,26 @@ concept OStream = requires(T a, int b) {
     } -> std::same_as<T &>;
 };
 
+// Finishes `output`. Streams with a Close report errors there instead of
+// in their destructor, the others finish on destruction.
+template <OStream O> arrow::Status CloseOutput(O &output) {
+  if constexpr (requires {
+                  { output.Close() } -> std::same_as<arrow::Status>;
+                }) {
+    return output.Close();
+  } else {
+    return arrow::Status::OK();
+  }
+}
+
+// Input whose next row can be compared by key and passed on without being
+// deserialized
+template <class T>
+concept RecordIStream = IStream<T> && requires(T a) {
+  typename T::key_type;
+  { a.Key() } -> std::same_as<typename T::key_type>;
+};
+
 template <class T>
 concept IOStreams = IStream<typename T::input> && OStream<typename T::output>;
 
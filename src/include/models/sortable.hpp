@@ -9,6 +9,15 @@ concept Sortable = models::Streamable<T> && requires(const T &a, KeyF key) {
   { std::invoke(key, a) } -> std::unsigned_integral;
 };
 
+template <class B, class T>
+concept SortBuffer = requires(B &buffer, const B &const_buffer, size_t ind) {
+  buffer.key;
+  { const_buffer.Size() } -> std::same_as<size_t>;
+  { static_cast<T>(const_buffer[ind]) };
+  buffer.Sort(ind);
+  { const_buffer.Sorted(ind) } -> std::same_as<bool>;
+};
+
 template <class T, class KeyF>
 using SortKey = std::decay_t<std::invoke_result_t<KeyF, const T &>>;
 
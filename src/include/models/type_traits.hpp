@@ -27,6 +27,13 @@ template <> struct TypeTraits<std::string> {
       arrow::utf8();
 };
 
+template <> struct TypeTraits<std::string_view> {
+  using builder_type = arrow::StringBuilder;
+  using array_type = arrow::StringArray;
+  static inline const std::shared_ptr<arrow::DataType> &field_type =
+      arrow::utf8();
+};
+
 template <class T> using BuilderT = typename TypeTraits<T>::builder_type;
 template <class T> using ArrayT = typename TypeTraits<T>::array_type;
 
@@ -1,38 +1,346 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+
 #include <arrow/api.h>
 #include <arrow/compute/api.h>
 #include <arrow/io/file.h>
+#include <arrow/ipc/api.h>
 #include <parquet/arrow/reader.h>
 #include <parquet/arrow/schema.h>
 #include <parquet/arrow/writer.h>
 
+#include <sorting/settings.hpp>
+#include <sorting/spill_space.hpp>
+
 namespace sorting {
 
 struct ArrowParquetStats {
   std::chrono::duration<long long, std::milli> read{0};
   std::chrono::duration<long long, std::milli> sort_indices{0};
   std::chrono::duration<long long, std::milli> take{0};
+  std::chrono::duration<long long, std::milli> merge{0};
   std::chrono::duration<long long, std::milli> write{0};
 };
 
-inline arrow::Result<ArrowParquetStats>
-ArrowSort(std::string file_input, std::string file_output,
-          std::vector<arrow::compute::SortKey> sort_keys) {
-  ArrowParquetStats result;
+namespace details {
+
+inline std::shared_ptr<parquet::WriterProperties>
+ArrowWriterProps(const arrow::Schema &schema,
+                 const io::OutputOptions &output = {}) {
+  parquet::WriterProperties::Builder builder;
+  builder.compression(arrow::Compression::UNCOMPRESSED)
+      ->encoding(parquet::Encoding::PLAIN)
+      ->disable_dictionary();
+
+  std::shared_ptr<parquet::SchemaDescriptor> schema_descriptor;
+  PARQUET_THROW_NOT_OK(parquet::arrow::ToParquetSchema(
+      &schema, *builder.build(), &schema_descriptor));
+  io::ApplyOutputOptions(output, *schema_descriptor, builder);
+
+  return builder.build();
+}
+
+inline std::shared_ptr<parquet::ArrowWriterProperties> ArrowArrowWriterProps() {
+  return parquet::ArrowWriterProperties::Builder()
+      .store_schema()
+      ->set_use_threads(true)
+      ->build();
+}
+
+template <class ArrayType>
+int CompareValues(const arrow::Array &lhs, int64_t lhs_ind,
+                  const arrow::Array &rhs, int64_t rhs_ind) {
+  const auto lhs_val = static_cast<const ArrayType &>(lhs).GetView(lhs_ind);
+  const auto rhs_val = static_cast<const ArrayType &>(rhs).GetView(rhs_ind);
+  return (rhs_val < lhs_val) - (lhs_val < rhs_val);
+}
+
+using ValuesComparator = int (*)(const arrow::Array &, int64_t,
+                                 const arrow::Array &, int64_t);
+
+inline arrow::Result<ValuesComparator>
+GetValuesComparator(const arrow::DataType &type) {
+  switch (type.id()) {
+  case arrow::Type::UINT8:
+    return &CompareValues<arrow::UInt8Array>;
+  case arrow::Type::UINT16:
+    return &CompareValues<arrow::UInt16Array>;
+  case arrow::Type::UINT32:
+    return &CompareValues<arrow::UInt32Array>;
+  case arrow::Type::UINT64:
+    return &CompareValues<arrow::UInt64Array>;
+  case arrow::Type::INT8:
+    return &CompareValues<arrow::Int8Array>;
+  case arrow::Type::INT16:
+    return &CompareValues<arrow::Int16Array>;
+  case arrow::Type::INT32:
+    return &CompareValues<arrow::Int32Array>;
+  case arrow::Type::INT64:
+    return &CompareValues<arrow::Int64Array>;
+  case arrow::Type::FLOAT:
+    return &CompareValues<arrow::FloatArray>;
+  case arrow::Type::DOUBLE:
+    return &CompareValues<arrow::DoubleArray>;
+  case arrow::Type::STRING:
+    return &CompareValues<arrow::StringArray>;
+  case arrow::Type::LARGE_STRING:
+    return &CompareValues<arrow::LargeStringArray>;
+  case arrow::Type::BINARY:
+    return &CompareValues<arrow::BinaryArray>;
+  case arrow::Type::LARGE_BINARY:
+    return &CompareValues<arrow::LargeBinaryArray>;
+  default:
+    return arrow::Status::NotImplemented("merging on ", type.ToString(),
+                                         " keys");
+  }
+}
+
+// Current position in a sorted run spilled as an Arrow IPC file
+struct RunCursor {
+  std::shared_ptr<arrow::ipc::RecordBatchFileReader> reader;
+  int next_batch = 0;
+  std::shared_ptr<arrow::RecordBatch> batch;
+  std::vector<std::shared_ptr<arrow::Array>> keys;
+  int64_t row = 0;
+  // index of `batch` among the batches the pending output takes rows from
+  size_t source = 0;
+};
+
+// Compares the current rows of two runs by the sort keys, nulls go where
+// the null_placement of their key puts them
+class RunComparator {
+public:
+  RunComparator(const std::vector<arrow::compute::SortKey> &sort_keys,
+                std::vector<ValuesComparator> comparators)
+      : comparators_(std::move(comparators)) {
+    for (const auto &sort_key : sort_keys) {
+      descending_.push_back(sort_key.order ==
+                            arrow::compute::SortOrder::Descending);
+      nulls_first_.push_back(sort_key.null_placement ==
+                             arrow::compute::NullPlacement::AtStart);
+    }
+  }
+
+  // Negative, zero or positive as the row of `lhs` goes before, together
+  // with or after the row of `rhs`
+  int Compare(const RunCursor &lhs, const RunCursor &rhs) const {
+    for (size_t ind = 0; ind != comparators_.size(); ++ind) {
+      const arrow::Array &lhs_key = *lhs.keys[ind];
+      const arrow::Array &rhs_key = *rhs.keys[ind];
+      const bool lhs_null = lhs_key.IsNull(lhs.row);
+      const bool rhs_null = rhs_key.IsNull(rhs.row);
+
+      if (lhs_null || rhs_null) {
+        if (lhs_null != rhs_null) {
+          return lhs_null == nulls_first_[ind] ? -1 : 1;
+        }
+        continue;
+      }
+
+      const int cmp = comparators_[ind](lhs_key, lhs.row, rhs_key, rhs.row);
+      if (cmp) {
+        return descending_[ind] ? -cmp : cmp;
+      }
+    }
+    return 0;
+  }
+
+  bool Less(const RunCursor &lhs, const RunCursor &rhs) const {
+    return Compare(lhs, rhs) < 0;
+  }
+
+private:
+  std::vector<ValuesComparator> comparators_;
+  std::vector<bool> descending_;
+  std::vector<bool> nulls_first_;
+};
+
+inline arrow::Status
+ReadRunBatch(RunCursor &cursor,
+             const std::vector<arrow::compute::SortKey> &sort_keys) {
+  cursor.batch.reset();
+  cursor.row = 0;
+
+  while (!cursor.batch &&
+         cursor.next_batch != cursor.reader->num_record_batches()) {
+    ARROW_ASSIGN_OR_RAISE(cursor.batch,
+                          cursor.reader->ReadRecordBatch(cursor.next_batch));
+    ++cursor.next_batch;
+
+    if (cursor.batch->num_rows() == 0) {
+      cursor.batch.reset();
+    }
+  }
+
+  cursor.keys.clear();
+  if (cursor.batch) {
+    for (const auto &sort_key : sort_keys) {
+      ARROW_ASSIGN_OR_RAISE(auto key, sort_key.target.GetOne(*cursor.batch));
+      cursor.keys.push_back(std::move(key));
+    }
+  }
+
+  return arrow::Status::OK();
+}
+
+template <class Stat, class F> arrow::Status Timed(Stat &stat, F f) {
+  const auto begin = std::chrono::high_resolution_clock::now();
+  const arrow::Status status = f();
+  stat += std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::high_resolution_clock::now() - begin);
+  return status;
+}
+
+using TableSink = std::function<arrow::Status(const arrow::Table &)>;
+
+// Merges the sorted IPC runs at `paths` in one memory mapped pass, holding a
+// batch per run. Every `batch_rows` merged rows are taken from their batches
+// and handed to `write`. Rows with equal keys keep the order of their runs in
+// `paths`, so runs given in input order merge stably.
+inline arrow::Status
+MergeArrowRuns(const std::vector<std::string> &paths,
+               const std::shared_ptr<arrow::Schema> &schema,
+               const std::vector<arrow::compute::SortKey> &sort_keys,
+               const RunComparator &comparator, size_t batch_rows,
+               const TableSink &write, ArrowParquetStats &result) {
+  const size_t runs_num = paths.size();
+  std::vector<RunCursor> cursors(runs_num);
+  // batches the pending output rows are taken from, `inds` index into their
+  // concatenation
+  std::vector<std::shared_ptr<arrow::RecordBatch>> sources;
+  std::vector<int64_t> offsets;
+  int64_t sources_rows = 0;
+  arrow::UInt64Builder inds;
+
+  const auto add_source = [&](RunCursor &cursor) {
+    cursor.source = sources.size();
+    sources.push_back(cursor.batch);
+    offsets.push_back(sources_rows);
+    sources_rows += cursor.batch->num_rows();
+  };
+
+  for (size_t run = 0; run != runs_num; ++run) {
+    std::shared_ptr<arrow::io::MemoryMappedFile> file;
+    ARROW_ASSIGN_OR_RAISE(file, arrow::io::MemoryMappedFile::Open(
+                                    paths[run], arrow::io::FileMode::READ));
+    ARROW_ASSIGN_OR_RAISE(cursors[run].reader,
+                          arrow::ipc::RecordBatchFileReader::Open(file));
+    ARROW_RETURN_NOT_OK(ReadRunBatch(cursors[run], sort_keys));
+  }
+
+  // the top of the heap is the least row, the earliest run among equals
+  const auto cmp = [&](size_t lhs, size_t rhs) {
+    const int order = comparator.Compare(cursors[rhs], cursors[lhs]);
+    return order ? order < 0 : rhs < lhs;
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> heap(cmp);
+
+  for (size_t run = 0; run != runs_num; ++run) {
+    if (cursors[run].batch) {
+      add_source(cursors[run]);
+      heap.push(run);
+    }
+  }
+
+  const auto emit = [&]() -> arrow::Status {
+    std::shared_ptr<arrow::Array> take_inds;
+    ARROW_RETURN_NOT_OK(inds.Finish(&take_inds));
+
+    ARROW_ASSIGN_OR_RAISE(auto table,
+                          arrow::Table::FromRecordBatches(schema, sources));
+    arrow::Datum sorted_table;
+    ARROW_RETURN_NOT_OK(Timed(result.take, [&] {
+      return arrow::compute::Take(table, take_inds).Value(&sorted_table);
+    }));
+
+    ARROW_RETURN_NOT_OK(
+        Timed(result.write, [&] { return write(*sorted_table.table()); }));
+
+    sources.clear();
+    offsets.clear();
+    sources_rows = 0;
+    for (auto &cursor : cursors) {
+      if (cursor.batch) {
+        add_source(cursor);
+      }
+    }
+
+    return arrow::Status::OK();
+  };
+
+  ARROW_RETURN_NOT_OK(inds.Reserve(batch_rows));
+  auto merge_begin = std::chrono::high_resolution_clock::now();
+
+  while (!heap.empty()) {
+    const size_t run = heap.top();
+    heap.pop();
 
+    auto &cursor = cursors[run];
+    inds.UnsafeAppend(offsets[cursor.source] + cursor.row);
+
+    if (++cursor.row == cursor.batch->num_rows()) {
+      ARROW_RETURN_NOT_OK(ReadRunBatch(cursor, sort_keys));
+      if (cursor.batch) {
+        add_source(cursor);
+      }
+    }
+    if (cursor.batch) {
+      heap.push(run);
+    }
+
+    if (static_cast<size_t>(inds.length()) == batch_rows || heap.empty()) {
+      result.merge += std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::high_resolution_clock::now() - merge_begin);
+
+      ARROW_RETURN_NOT_OK(emit());
+      ARROW_RETURN_NOT_OK(inds.Reserve(batch_rows));
+
+      merge_begin = std::chrono::high_resolution_clock::now();
+    }
+  }
+
+  return arrow::Status::OK();
+}
+
+inline arrow::Result<std::unique_ptr<parquet::arrow::FileReader>>
+OpenParquet(const std::string &filename) {
   std::shared_ptr<arrow::io::RandomAccessFile> input;
-  ARROW_ASSIGN_OR_RAISE(input, arrow::io::ReadableFile::Open(file_input));
+  ARROW_ASSIGN_OR_RAISE(input, arrow::io::ReadableFile::Open(filename));
 
-  arrow::MemoryPool *pool = arrow::default_memory_pool();
   std::unique_ptr<parquet::arrow::FileReader> arrow_reader;
-  ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(input, pool, &arrow_reader));
+  ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(
+      input, arrow::default_memory_pool(), &arrow_reader));
+  return arrow_reader;
+}
+
+} // namespace details
+
+// `file_input` may be a directory of parquet part files, `file_output` a
+// directory that receives a single part file
+inline arrow::Result<ArrowParquetStats>
+ArrowSort(std::string file_input, std::string file_output,
+          std::vector<arrow::compute::SortKey> sort_keys,
+          const io::OutputOptions &output = {}) {
+  ArrowParquetStats result;
 
   std::shared_ptr<arrow::Table> table;
   {
     auto begin = std::chrono::high_resolution_clock::now();
 
-    ARROW_RETURN_NOT_OK(arrow_reader->ReadTable(&table));
+    std::vector<std::shared_ptr<arrow::Table>> tables;
+    for (const auto &filename : io::ListInputFiles(file_input)) {
+      ARROW_ASSIGN_OR_RAISE(auto arrow_reader,
+                            details::OpenParquet(filename));
+      ARROW_RETURN_NOT_OK(arrow_reader->ReadTable(&tables.emplace_back()));
+    }
+    ARROW_ASSIGN_OR_RAISE(table, arrow::ConcatenateTables(tables));
 
     result.read += std::chrono::duration_cast<std::chrono::milliseconds>(
         std::chrono::high_resolution_clock::now() - begin);
@@ -67,18 +375,13 @@ ArrowSort(std::string file_input, std::string file_output,
   }
 
   std::shared_ptr<parquet::WriterProperties> props =
-      parquet::WriterProperties::Builder()
-          .compression(arrow::Compression::UNCOMPRESSED)
-          ->encoding(parquet::Encoding::PLAIN)
-          ->disable_dictionary()
-          ->build();
-
+      details::ArrowWriterProps(*sorted_table.table()->schema(), output);
   std::shared_ptr<parquet::ArrowWriterProperties> arrow_props =
-      parquet::ArrowWriterProperties::Builder().store_schema()->build();
+      details::ArrowArrowWriterProps();
 
   std::shared_ptr<arrow::io::FileOutputStream> outfile;
-  ARROW_ASSIGN_OR_RAISE(outfile,
-                        arrow::io::FileOutputStream::Open(file_output));
+  ARROW_ASSIGN_OR_RAISE(outfile, arrow::io::FileOutputStream::Open(
+                                     io::OutputFile(file_output)));
   {
     auto begin = std::chrono::high_resolution_clock::now();
 
@@ -93,4 +396,165 @@ ArrowSort(std::string file_input, std::string file_output,
   return result;
 }
 
+// External sort of an arbitrary parquet schema that stays columnar: runs of
+// `run_rows` rows are sorted with sort_indices + take and spilled as Arrow
+// IPC files, then merged in memory mapped passes of at most `batches_num`
+// runs that emit batches of `batch_rows` rows via take. The sort is stable.
+inline arrow::Result<ArrowParquetStats>
+ArrowMergeSort(std::string file_input, std::string file_output,
+               std::vector<arrow::compute::SortKey> sort_keys, size_t run_rows,
+               size_t batch_rows = 1ul << 16,
+               const io::OutputOptions &output = {},
+               const std::vector<std::string> &spill_dirs = {kTmpSortDir},
+               size_t batches_num = 256) {
+  ArrowParquetStats result;
+
+  arrow::MemoryPool *pool = arrow::default_memory_pool();
+  const auto files = io::ListInputFiles(file_input);
+  if (files.empty()) {
+    return arrow::Status::Invalid("No input files in ", file_input);
+  }
+
+  std::shared_ptr<arrow::Schema> schema;
+  {
+    ARROW_ASSIGN_OR_RAISE(auto arrow_reader, details::OpenParquet(files[0]));
+    ARROW_RETURN_NOT_OK(arrow_reader->GetSchema(&schema));
+  }
+
+  std::vector<details::ValuesComparator> comparators;
+  for (const auto &sort_key : sort_keys) {
+    ARROW_ASSIGN_OR_RAISE(auto field, sort_key.target.GetOne(*schema));
+    ARROW_ASSIGN_OR_RAISE(auto comparator,
+                          details::GetValuesComparator(*field->type()));
+    comparators.push_back(comparator);
+  }
+
+  arrow::compute::SortOptions sort_options;
+  sort_options.sort_keys = sort_keys;
+
+  SpillSpace spill(spill_dirs);
+  spill.Create();
+  size_t runs_num = 0;
+
+  const auto spill_run = [&](std::vector<std::shared_ptr<arrow::Table>> &tables)
+      -> arrow::Status {
+    ARROW_ASSIGN_OR_RAISE(auto table, arrow::ConcatenateTables(tables));
+    tables.clear();
+
+    arrow::Datum sorted_inds;
+    ARROW_RETURN_NOT_OK(details::Timed(result.sort_indices, [&] {
+      return arrow::compute::CallFunction("sort_indices", {table},
+                                          &sort_options)
+          .Value(&sorted_inds);
+    }));
+
+    arrow::Datum sorted_table;
+    ARROW_RETURN_NOT_OK(details::Timed(result.take, [&] {
+      return arrow::compute::Take(table, sorted_inds).Value(&sorted_table);
+    }));
+
+    return details::Timed(result.write, [&]() -> arrow::Status {
+      ARROW_ASSIGN_OR_RAISE(auto outfile,
+                            arrow::io::FileOutputStream::Open(
+                                spill.Path(runs_num++)));
+      ARROW_ASSIGN_OR_RAISE(auto writer,
+                            arrow::ipc::MakeFileWriter(outfile, schema));
+      ARROW_RETURN_NOT_OK(
+          writer->WriteTable(*sorted_table.table(), batch_rows));
+      ARROW_RETURN_NOT_OK(writer->Close());
+      return outfile->Close();
+    });
+  };
+
+  {
+    std::vector<std::shared_ptr<arrow::Table>> tables;
+    size_t rows = 0;
+
+    for (const auto &filename : files) {
+      ARROW_ASSIGN_OR_RAISE(auto arrow_reader, details::OpenParquet(filename));
+
+      for (int row_group = 0; row_group != arrow_reader->num_row_groups();
+           ++row_group) {
+        std::shared_ptr<arrow::Table> table;
+        ARROW_RETURN_NOT_OK(details::Timed(result.read, [&] {
+          return arrow_reader->ReadRowGroup(row_group, &table);
+        }));
+
+        rows += table->num_rows();
+        tables.push_back(std::move(table));
+
+        if (rows >= run_rows) {
+          ARROW_RETURN_NOT_OK(spill_run(tables));
+          rows = 0;
+        }
+      }
+    }
+
+    if (!tables.empty()) {
+      ARROW_RETURN_NOT_OK(spill_run(tables));
+    }
+  }
+
+  const details::RunComparator comparator(sort_keys, std::move(comparators));
+
+  // merges runs [from, to) into `write`, the runs are removed afterwards
+  const auto merge = [&](size_t from, size_t to,
+                         const details::TableSink &write) -> arrow::Status {
+    std::vector<std::string> paths;
+    for (size_t run = from; run != to; ++run) {
+      paths.push_back(spill.Path(run));
+    }
+    ARROW_RETURN_NOT_OK(details::MergeArrowRuns(
+        paths, schema, sort_keys, comparator, batch_rows, write, result));
+    for (const auto &path : paths) {
+      std::filesystem::remove(path);
+    }
+    return arrow::Status::OK();
+  };
+
+  // at most `batches_num` runs are open at once: while the runs do not fit
+  // the last pass, a pass merges each consecutive group of them into a new
+  // run. Runs [cur_run, runs_num) stay in input order, which the merge needs
+  // to be stable.
+  batches_num = std::max<size_t>(batches_num, 2);
+  size_t cur_run = 0;
+  while (runs_num - cur_run > batches_num) {
+    const size_t pass_end = runs_num;
+    while (cur_run != pass_end) {
+      const size_t to = std::min(cur_run + batches_num, pass_end);
+      ARROW_ASSIGN_OR_RAISE(auto outfile, arrow::io::FileOutputStream::Open(
+                                              spill.Path(runs_num++)));
+      ARROW_ASSIGN_OR_RAISE(auto writer,
+                            arrow::ipc::MakeFileWriter(outfile, schema));
+      ARROW_RETURN_NOT_OK(merge(cur_run, to, [&](const arrow::Table &table) {
+        return writer->WriteTable(table, batch_rows);
+      }));
+      ARROW_RETURN_NOT_OK(writer->Close());
+      ARROW_RETURN_NOT_OK(outfile->Close());
+      cur_run = to;
+    }
+  }
+
+  // an input without rows still gets an empty output with its schema
+  std::shared_ptr<arrow::io::FileOutputStream> outfile;
+  ARROW_ASSIGN_OR_RAISE(outfile, arrow::io::FileOutputStream::Open(
+                                     io::OutputFile(file_output)));
+  std::unique_ptr<parquet::arrow::FileWriter> writer;
+  ARROW_ASSIGN_OR_RAISE(
+      writer, parquet::arrow::FileWriter::Open(
+                  *schema, pool, outfile,
+                  details::ArrowWriterProps(*schema, output),
+                  details::ArrowArrowWriterProps()));
+  ARROW_RETURN_NOT_OK(merge(cur_run, runs_num, [&](const arrow::Table &table) {
+    return writer->WriteTable(table, batch_rows);
+  }));
+
+  ARROW_RETURN_NOT_OK(writer->Close());
+  ARROW_RETURN_NOT_OK(outfile->Close());
+
+  spill.Remove();
+
+  return result;
+}
+
 } // namespace sorting
@@ -20,8 +20,10 @@
 #include <models/io_stream.hpp>
 #include <models/sortable.hpp>
 #include <sorting/bucket_split.hpp>
+#include <sorting/partitioned_output.hpp>
 #include <sorting/settings.hpp>
 #include <sorting/sort_buffer.hpp>
+#include <sorting/spill_space.hpp>
 
 namespace sorting {
 
@@ -35,7 +37,8 @@ template <class T, class KeyF> struct BucketRange {
 template <models::OStream O, class T, class KeyF, models::IStream I>
 arrow::Status SplitIntoBuckets(SortBuffer<T, KeyF> &buffer,
                                std::vector<BucketRange<T, KeyF>> &stack,
-                               I input, const io::Settings &settings) {
+                               I input, SpillSpace &spill,
+                               const io::Settings &settings) {
   using BucketSortKey = models::SortKey<T, KeyF>;
 
   const BucketSortKey min = stack.back().min;
@@ -60,7 +63,7 @@ arrow::Status SplitIntoBuckets(SortBuffer<T, KeyF> &buffer,
     const BucketSortKey r = splitter.Max(ind);
 
     stack.push_back({file_id, l, r});
-    outputs[ind] = O(kTmpSortDir + std::to_string(file_id), settings);
+    outputs[ind] = OpenRun<O>(spill.Path(file_id), settings, buffer.key);
   }
 
   for (size_t ind = 0; ind != buffer.Size(); ++ind) {
@@ -69,11 +72,18 @@ arrow::Status SplitIntoBuckets(SortBuffer<T, KeyF> &buffer,
   }
 
   while (!input.Eof()) {
-    input >> buffer[0];
-    const size_t batch_ind = splitter(std::invoke(buffer.key, buffer[0]));
-    outputs[batch_ind] << buffer[0];
+    if constexpr (models::RecordIStream<I>) {
+      input.Emit(outputs[splitter(input.Key())]);
+    } else {
+      input >> buffer[0];
+      const size_t batch_ind = splitter(std::invoke(buffer.key, buffer[0]));
+      outputs[batch_ind] << buffer[0];
+    }
   }
 
+  for (auto &output : outputs) {
+    ARROW_RETURN_NOT_OK(models::CloseOutput(output));
+  }
   return arrow::Status::OK();
 }
 
@@ -84,14 +94,23 @@ template <class T, models::IStream I, models::IOStreams M_IO, models::OStream O,
 arrow::Status BucketSort(std::string file_input, const std::string &file_output,
                          size_t buckets_num, SortBuffer<T, KeyF> &buffer,
                          models::SortKey<T, KeyF> min,
-                         models::SortKey<T, KeyF> max) {
+                         models::SortKey<T, KeyF> max,
+                         const SortOptions &options = {}) {
   static_assert(models::Sortable<T, KeyF>);
 
   using M_I = typename M_IO::input;
   using M_O = typename M_IO::output;
 
-  io::Settings settings(buffer.Size(), buckets_num, sizeof(T), file_input);
-  O output(file_output, settings);
+  io::Settings settings(buffer.Size(), buckets_num, sizeof(T), file_input, {},
+                        options.spill);
+  settings.Use(options.pool);
+  io::Settings output_settings(buffer.Size(), buckets_num, sizeof(T),
+                               file_input, details::SortedOutput(options));
+  output_settings.Use(options.pool);
+  PartitionedOStream<T, O, KeyF> output(file_output, output_settings,
+                                        buffer.key, options.partitions);
+  bool partitioned = false;
+  SpillSpace spill(options);
 
   std::vector<details::BucketRange<T, KeyF>> stack;
 
@@ -100,51 +119,65 @@ arrow::Status BucketSort(std::string file_input, const std::string &file_output,
     const bool single_value = stack.back().min == stack.back().max;
 
     size_t last_ind = 0;
+    if (!single_value) {
+      last_ind = buffer.Read(input, settings.total_rows);
+    }
+
+    // output partition boundaries are sampled from the first block, buckets
+    // come out in key order so files are cut at bucket boundaries for free
+    if (!partitioned) {
+      const size_t samples_num = last_ind ? options.partitions * 64 : 0;
+      std::vector<models::SortKey<T, KeyF>> samples(samples_num);
+      for (size_t ind = 0; ind != samples_num; ++ind) {
+        samples[ind] =
+            std::invoke(buffer.key, buffer[ind * last_ind / samples_num]);
+      }
+      output.Partition(std::move(samples), min, max);
+      partitioned = true;
+    }
+
     if (single_value) {
       while (!input.Eof()) {
         input >> buffer[0];
         output << buffer[0];
-        ++last_ind;
-      }
-    } else {
-      while (!input.Eof() && last_ind != settings.total_rows) {
-        input >> buffer[last_ind];
-        ++last_ind;
       }
     }
 
     if (!input.Eof()) {
       ARROW_RETURN_NOT_OK(details::SplitIntoBuckets<M_O>(
-          buffer, stack, std::move(input), settings));
+          buffer, stack, std::move(input), spill, settings));
     } else {
       if (!single_value) {
         buffer.Sort(last_ind, stack.back().min, stack.back().max);
-        for (size_t ind = 0; ind != last_ind; ++ind) {
-          output << buffer[ind];
-        }
+        buffer.Write(output, last_ind);
       }
       stack.pop_back();
     }
 
     input = decltype(input){};
-    std::filesystem::remove(kTmpSortDir + std::to_string(input_id));
+    if (input_id) {
+      std::filesystem::remove(spill.Path(input_id));
+    }
 
     if (!stack.empty()) {
-      file_input = kTmpSortDir + std::to_string(stack.back().file_id);
+      file_input = spill.Path(stack.back().file_id);
     }
 
     return arrow::Status::OK();
   };
 
-  std::filesystem::create_directory(kTmpSortDir);
+  spill.Create();
 
   stack.push_back({0, min, max});
-  ARROW_RETURN_NOT_OK(bucket_step(I(file_input, settings)));
+  ARROW_ASSIGN_OR_RAISE(I input,
+                        details::OpenInput<I>(file_input, settings, options));
+  ARROW_RETURN_NOT_OK(bucket_step(std::move(input)));
   while (!stack.empty()) {
     ARROW_RETURN_NOT_OK(bucket_step(M_I(file_input, settings)));
   }
 
-  std::filesystem::remove_all(kTmpSortDir);
+  ARROW_RETURN_NOT_OK(output.Close());
+  spill.Remove();
 
   return arrow::Status::OK();
 }
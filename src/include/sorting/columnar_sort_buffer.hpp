@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <functional>
+#include <limits>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <io/row.hpp>
+#include <sorting/presorted.hpp>
+#include <sorting/sort_buffer.hpp>
+
+namespace sorting {
+
+template <class T, class KeyF> class ColumnarSortBuffer;
+
+// Stores every field in its own column and sorts (key, index) pairs only,
+// the permutation is applied lazily column by column when rows are written
+// out, so row width barely affects the cost of Sort
+template <class... Fields, class KeyF>
+class ColumnarSortBuffer<io::Row<Fields...>, KeyF> {
+  using T = io::Row<Fields...>;
+
+public:
+  using KeyT = std::invoke_result_t<KeyF, const T &>;
+  static_assert(std::unsigned_integral<KeyT>);
+
+  ColumnarSortBuffer(size_t size, KeyF key, const MemoryOptions &memory = {})
+      : key(key),
+        columns_(SortVector<typename Fields::type>(
+            size, SortAllocator<typename Fields::type>(memory))...),
+        keyed_inds_(size, SortAllocator<details::KeyedInd<KeyT>>(memory)),
+        extra_(size, SortAllocator<details::KeyedInd<KeyT>>(memory)),
+        rows_(T::kBlockRows) {}
+
+  T operator[](size_t ind) const {
+    T row;
+    Gather(&row, ind, 1, std::make_index_sequence<sizeof...(Fields)>{});
+    return row;
+  }
+
+  size_t Size() const { return keyed_inds_.size(); }
+
+  void Clear() {
+    std::apply(
+        [](auto &...columns) {
+          (..., (columns.clear(), columns.shrink_to_fit()));
+        },
+        columns_);
+    keyed_inds_.clear();
+    keyed_inds_.shrink_to_fit();
+    extra_.clear();
+    extra_.shrink_to_fit();
+    rows_.clear();
+    rows_.shrink_to_fit();
+    arena_.Release();
+  }
+
+  // Whether the first `size` rows are already in key order
+  bool Sorted(size_t size) const {
+    return std::is_sorted(keyed_inds_.begin(), keyed_inds_.begin() + size,
+                          [](const details::KeyedInd<KeyT> &lhs,
+                             const details::KeyedInd<KeyT> &rhs) {
+                            return lhs.key < rhs.key;
+                          });
+  }
+
+  void Sort(size_t size, KeyT min = std::numeric_limits<KeyT>::min(),
+            KeyT max = std::numeric_limits<KeyT>::max()) {
+    const auto key_of = [](const details::KeyedInd<KeyT> &keyed_ind) {
+      return keyed_ind.key;
+    };
+    if (details::SortPresorted(keyed_inds_.data(), size, std::span(extra_),
+                               key_of)) {
+      return;
+    }
+    RadixSort(keyed_inds_, extra_, size, min, max, key_of);
+  }
+
+  // Fills the buffer from `input` through a block of rows, returns the number
+  // of rows read
+  template <class I> size_t Read(I &input, size_t count) {
+    arena_.Reset();
+    size_t read = 0;
+
+    while (read != count && !input.Eof()) {
+      const size_t step = std::min(rows_.size(), count - read);
+
+      size_t block;
+      if constexpr (requires { input.Read(rows_.data(), step); }) {
+        block = input.Read(rows_.data(), step);
+        Store(0, block);
+      } else {
+        for (block = 0; block != step && !input.Eof(); ++block) {
+          input >> rows_[block];
+          Store(block, 1);
+        }
+      }
+
+      Scatter(read, block, std::make_index_sequence<sizeof...(Fields)>{});
+      read += block;
+    }
+
+    return read;
+  }
+
+  template <class O> void Write(O &output, size_t count) {
+    for (size_t from = 0; from < count; from += rows_.size()) {
+      const size_t block = std::min(rows_.size(), count - from);
+      Gather(rows_.data(), from, block,
+             std::make_index_sequence<sizeof...(Fields)>{});
+
+      if constexpr (requires { output.Write(rows_.data(), block); }) {
+        output.Write(rows_.data(), block);
+      } else {
+        for (size_t ind = 0; ind != block; ++ind) {
+          output << rows_[ind];
+        }
+      }
+    }
+  }
+
+private:
+  // Bytes of string_view fields go to the arena of the block, the rows they
+  // were read into are reused
+  void Store(size_t from, size_t count) {
+    if constexpr (io::ArenaBacked<T>) {
+      for (size_t ind = from; ind != from + count; ++ind) {
+        rows_[ind].Store(arena_);
+      }
+    }
+  }
+
+  template <size_t... Is>
+  void Scatter(size_t from, size_t count, std::index_sequence<Is...>) {
+    for (size_t ind = 0; ind != count; ++ind) {
+      keyed_inds_[from + ind].key = std::invoke(key, rows_[ind]);
+      keyed_inds_[from + ind].ind = from + ind;
+    }
+
+    (..., [&] {
+      auto *column = std::get<Is>(columns_).data() + from;
+      for (size_t ind = 0; ind != count; ++ind) {
+        column[ind] = std::move(rows_[ind].*Fields::kField);
+      }
+    }());
+  }
+
+  template <size_t... Is>
+  void Gather(T *rows, size_t from, size_t count,
+              std::index_sequence<Is...>) const {
+    (..., [&] {
+      const auto &column = std::get<Is>(columns_);
+      for (size_t ind = 0; ind != count; ++ind) {
+        rows[ind].*Fields::kField = column[keyed_inds_[from + ind].ind];
+      }
+    }());
+  }
+
+public:
+  KeyF key;
+
+private:
+  std::tuple<SortVector<typename Fields::type>...> columns_;
+  SortVector<details::KeyedInd<KeyT>> keyed_inds_;
+  SortVector<details::KeyedInd<KeyT>> extra_;
+  std::vector<T> rows_;
+  io::Arena arena_;
+};
+
+} // namespace sorting
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <arrow/api.h>
+#include <parquet/arrow/reader.h>
+
+#include <io/arena.hpp>
+#include <io/batch_stream.hpp>
+#include <io/row.hpp>
+#include <io/settings.hpp>
+#include <models/io_stream.hpp>
+#include <models/sortable.hpp>
+#include <sorting/merge_sort.hpp>
+#include <sorting/settings.hpp>
+#include <sorting/sort_buffer.hpp>
+#include <sorting/spill_space.hpp>
+
+namespace sorting {
+
+namespace details {
+
+IOFIELD(uint64_t, key);
+IOFIELD(uint64_t, row_group);
+IOFIELD(uint64_t, row_offset);
+
+} // namespace details
+
+// Position of a row in the source parquet file together with its sort key
+using RowRef = io::Row<details::IOFieldNkey, details::IOFieldNrow_group,
+                       details::IOFieldNrow_offset>;
+
+namespace details {
+
+inline uint64_t RowRefKey(const RowRef &ref) { return ref.key; }
+
+template <class T> class RowGroupReader {
+public:
+  RowGroupReader(const std::string &filename,
+                 const io::ParquetSettings &settings,
+                 const std::optional<std::string> &key_column = std::nullopt)
+      : key_column_(key_column) {
+    parquet::arrow::FileReaderBuilder reader_builder;
+    PARQUET_THROW_NOT_OK(
+        reader_builder.OpenFile(filename, false, settings.reader_props));
+    reader_builder.memory_pool(arrow::default_memory_pool());
+    reader_builder.properties(settings.arrow_reader_props);
+    PARQUET_ASSIGN_OR_THROW(arrow_reader_, reader_builder.Build());
+
+    const auto &schema = *arrow_reader_->parquet_reader()->metadata()->schema();
+    for (const auto &field : T::kSchema->fields()) {
+      columns_.push_back(schema.ColumnIndex(field->name()));
+    }
+  }
+
+  int RowGroups() const { return arrow_reader_->num_row_groups(); }
+
+  // Rows of `row_group` for computing keys: with a key column only that
+  // column is decoded and the other fields of T read as zeros
+  std::shared_ptr<arrow::RecordBatch> ReadKeys(int row_group) {
+    if (!key_column_) {
+      return Read(row_group);
+    }
+
+    const int column = T::kSchema->GetFieldIndex(*key_column_);
+    std::shared_ptr<arrow::Table> table;
+    PARQUET_THROW_NOT_OK(
+        arrow_reader_->ReadRowGroup(row_group, {columns_[column]}, &table));
+    std::shared_ptr<arrow::RecordBatch> keys;
+    PARQUET_ASSIGN_OR_THROW(keys, table->CombineChunksToBatch());
+
+    std::vector<std::shared_ptr<arrow::Array>> arrays;
+    for (const auto &field : T::kSchema->fields()) {
+      if (field->name() == *key_column_) {
+        arrays.push_back(keys->column(0));
+      } else {
+        std::shared_ptr<arrow::Array> blank;
+        PARQUET_ASSIGN_OR_THROW(
+            blank, arrow::MakeArrayOfNull(field->type(), keys->num_rows()));
+        arrays.push_back(std::move(blank));
+      }
+    }
+    return arrow::RecordBatch::Make(T::kSchema, keys->num_rows(),
+                                    std::move(arrays));
+  }
+
+  std::shared_ptr<arrow::RecordBatch> Read(int row_group) {
+    std::shared_ptr<arrow::Table> table;
+    PARQUET_THROW_NOT_OK(
+        arrow_reader_->ReadRowGroup(row_group, columns_, &table));
+
+    std::shared_ptr<arrow::RecordBatch> batch;
+    PARQUET_ASSIGN_OR_THROW(batch, table->CombineChunksToBatch());
+    return io::details::Project<T>(batch);
+  }
+
+private:
+  std::unique_ptr<parquet::arrow::FileReader> arrow_reader_;
+  std::vector<int> columns_;
+  std::optional<std::string> key_column_;
+};
+
+} // namespace details
+
+struct LateMaterializationStats {
+  std::chrono::duration<uint64_t, std::milli> keys{0};
+  std::chrono::duration<uint64_t, std::milli> sort{0};
+  std::chrono::duration<uint64_t, std::milli> merge{0};
+  std::chrono::duration<uint64_t, std::milli> gather{0};
+  // row groups decoded by the gather
+  size_t gather_row_groups = 0;
+};
+
+// Sorts a parquet file of wide rows by external sorting only (key, row group,
+// row offset) references and then gathering the rows from the source file in
+// output order, `memory / sizeof(T)` rows at a time. Spill runs and merge
+// passes carry 24 byte references instead of whole rows, so M_IO is a stream
+// family of RowRef. If the key of a row is the value of `key_column`, the
+// key pass decodes only that column.
+//
+// Parquet is decoded a row group at a time, so every chunk of the gather
+// decodes each row group it takes a row from. With unordered keys a chunk
+// touches nearly all of them and the gather reads the input about
+// rows * sizeof(T) / memory times: late materialization pays off while
+// `memory` holds a good share of the rows, or the keys follow the input
+// order. gather_row_groups in the result counts the decoded row groups.
+template <class T, models::IOStreams M_IO, models::OStream O, class KeyF>
+arrow::Result<LateMaterializationStats>
+LateMaterializationSort(
+    const std::string &file_input, const std::string &file_output,
+    size_t batches_num, size_t memory, KeyF key,
+    const std::vector<std::string> &spill_dirs = {kTmpSortDir},
+    const std::optional<std::string> &key_column = std::nullopt) {
+  static_assert(models::Sortable<T, KeyF>);
+
+  using M_I = typename M_IO::input;
+  using M_O = typename M_IO::output;
+
+  LateMaterializationStats result;
+
+  const auto since = [](auto begin) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - begin);
+  };
+
+  if (key_column && T::kSchema->GetFieldIndex(*key_column) < 0) {
+    return arrow::Status::Invalid("No field ", *key_column, " in the rows");
+  }
+
+  io::Settings settings(memory / sizeof(RowRef), batches_num, sizeof(RowRef),
+                        file_input);
+  details::RowGroupReader<T> reader(file_input, settings, key_column);
+
+  RadixSortBuffer<RowRef, decltype(&details::RowRefKey)> buffer(
+      settings.total_rows, &details::RowRefKey);
+  size_t last_ind = 0;
+  size_t last_file = 0;
+  SpillSpace spill(spill_dirs);
+
+  const auto spill_run = [&] {
+    auto begin = std::chrono::high_resolution_clock::now();
+    buffer.Sort(last_ind);
+    result.sort += since(begin);
+
+    begin = std::chrono::high_resolution_clock::now();
+    auto output = OpenRun<M_O>(spill.Path(last_file++), settings, buffer.key);
+    buffer.Write(output, last_ind);
+    last_ind = 0;
+    result.merge += since(begin);
+    return models::CloseOutput(output);
+  };
+
+  spill.Create();
+
+  {
+    std::vector<T> rows(T::kBlockRows);
+
+    for (int row_group = 0; row_group != reader.RowGroups(); ++row_group) {
+      auto begin = std::chrono::high_resolution_clock::now();
+
+      const auto batch = reader.ReadKeys(row_group);
+      typename T::BatchArray array(*batch);
+
+      for (int64_t from = 0; from < batch->num_rows();) {
+        // a full buffer is spilled only once more rows come, so input of
+        // a single block goes straight to the references file
+        if (last_ind == settings.total_rows) {
+          result.keys += since(begin);
+          ARROW_RETURN_NOT_OK(spill_run());
+          begin = std::chrono::high_resolution_clock::now();
+        }
+
+        const size_t block = std::min<size_t>(
+            {rows.size(), static_cast<size_t>(batch->num_rows() - from),
+             settings.total_rows - last_ind});
+        array.ReadRange(rows.data(), from, block);
+
+        for (size_t ind = 0; ind != block; ++ind, ++last_ind) {
+          buffer[last_ind].key = std::invoke(key, rows[ind]);
+          buffer[last_ind].row_group = row_group;
+          buffer[last_ind].row_offset = from + ind;
+        }
+        from += block;
+      }
+
+      result.keys += since(begin);
+    }
+  }
+
+  const std::string refs_file = spill.Path("refs");
+  if (last_file == 0) {
+    auto begin = std::chrono::high_resolution_clock::now();
+    buffer.Sort(last_ind);
+    result.sort += since(begin);
+
+    M_O output(refs_file, settings);
+    buffer.Write(output, last_ind);
+    ARROW_RETURN_NOT_OK(models::CloseOutput(output));
+  } else {
+    if (last_ind) {
+      ARROW_RETURN_NOT_OK(spill_run());
+    }
+
+    const auto begin = std::chrono::high_resolution_clock::now();
+    ARROW_RETURN_NOT_OK((details::MergePass<RowRef, decltype(buffer.key),
+                                            M_IO, M_O>(
+        refs_file, last_file - 1, spill, settings, settings, buffer.key)));
+    result.merge += since(begin);
+  }
+  buffer.Clear();
+
+  {
+    const auto begin = std::chrono::high_resolution_clock::now();
+
+    const size_t chunk_rows = std::max<size_t>(1, memory / sizeof(T));
+    std::vector<RowRef> refs(chunk_rows);
+    std::vector<size_t> order(chunk_rows);
+    std::vector<T> rows(chunk_rows);
+    io::Arena arena;
+
+    M_I refs_input(refs_file, settings);
+    O output(file_output, settings);
+
+    while (!refs_input.Eof()) {
+      size_t chunk = 0;
+      for (; chunk != chunk_rows && !refs_input.Eof(); ++chunk) {
+        refs_input >> refs[chunk];
+      }
+
+      // visit the chunk in file order so every row group is read once
+      std::iota(order.begin(), order.begin() + chunk, 0);
+      std::sort(order.begin(), order.begin() + chunk,
+                [&](size_t lhs, size_t rhs) {
+                  return std::tie(refs[lhs].row_group, refs[lhs].row_offset) <
+                         std::tie(refs[rhs].row_group, refs[rhs].row_offset);
+                });
+
+      arena.Reset();
+      for (size_t from = 0; from != chunk;) {
+        const uint64_t row_group = refs[order[from]].row_group;
+        const auto batch = reader.Read(row_group);
+        ++result.gather_row_groups;
+        typename T::BatchArray array(*batch);
+
+        for (; from != chunk && refs[order[from]].row_group == row_group;
+             ++from) {
+          array.Read(rows[order[from]], refs[order[from]].row_offset);
+          if constexpr (io::ArenaBacked<T>) {
+            rows[order[from]].Store(arena);
+          }
+        }
+      }
+
+      if constexpr (requires { output.Write(rows.data(), chunk); }) {
+        output.Write(rows.data(), chunk);
+      } else {
+        for (size_t ind = 0; ind != chunk; ++ind) {
+          output << rows[ind];
+        }
+      }
+    }
+    ARROW_RETURN_NOT_OK(models::CloseOutput(output));
+
+    result.gather += since(begin);
+  }
+
+  spill.Remove();
+
+  return result;
+}
+
+} // namespace sorting
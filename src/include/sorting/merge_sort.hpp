@@ -3,7 +3,9 @@
 #include <algorithm>
 #include <concepts>
 #include <filesystem>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <queue>
 #include <type_traits>
 #include <utility>
@@ -21,6 +23,7 @@
 #include <models/sortable.hpp>
 #include <sorting/settings.hpp>
 #include <sorting/sort_buffer.hpp>
+#include <sorting/spill_space.hpp>
 
 namespace sorting {
 
@@ -34,30 +37,45 @@ template <class T> struct MergeHeapNode {
   T val;
 };
 
-template <class T, models::IStream I, models::OStream O>
-void Merge(const std::string &file_output, size_t cur_file,
-           size_t file_merge_up_to, const io::Settings &settings, auto &heap) {
-  O output(file_output, settings);
+template <class T, class KeyF> auto MakeMergeHeap(KeyF key) {
+  using Node = details::MergeHeapNode<T>;
 
-  std::vector<I> inputs;
-  inputs.reserve(settings.batches_num);
+  const auto cmp = [key](const Node &lhs, const Node &rhs) {
+    return std::invoke(key, rhs.val) < std::invoke(key, lhs.val);
+  };
+  return std::priority_queue<Node, std::vector<Node>, decltype(cmp)>(cmp);
+}
 
-  for (size_t ind = 0, file_id = cur_file; file_id != file_merge_up_to;
-       ++ind, ++file_id) {
-    const auto filename = kTmpSortDir + std::to_string(file_id);
+// Merges sorted `files` into `output`, returns whether the output came out in
+// key order, which only fails if some input was not sorted
+template <class T, models::IStream I, class KeyF>
+bool Merge(models::OStream auto &output, const std::vector<std::string> &files,
+           const io::Settings &settings, auto &heap, KeyF key) {
+  std::vector<I> inputs;
+  inputs.reserve(files.size());
 
-    inputs.emplace_back(filename, settings);
+  for (size_t ind = 0; ind != files.size(); ++ind) {
+    inputs.emplace_back(files[ind], settings);
 
-    T val;
-    inputs.back() >> val;
-    heap.emplace(ind, val);
+    if (!inputs.back().Eof()) {
+      T val;
+      inputs.back() >> val;
+      heap.emplace(ind, val);
+    }
   };
 
+  bool sorted = true;
+  models::SortKey<T, KeyF> prev = 0;
+
   while (!heap.empty()) {
     const auto next_sorted = heap.top();
     heap.pop();
     output << next_sorted.val;
 
+    const auto next_key = std::invoke(key, next_sorted.val);
+    sorted &= prev <= next_key;
+    prev = next_key;
+
     if (!inputs[next_sorted.ind].Eof()) {
       T val;
       inputs[next_sorted.ind] >> val;
@@ -65,40 +83,94 @@ void Merge(const std::string &file_output, size_t cur_file,
     }
   }
 
-  heap.size();
+  return sorted;
+}
+
+// Merge of key-prefixed spill records: only keys are compared and records are
+// copied as raw bytes unless `output` needs rows
+template <models::RecordIStream I>
+bool MergeRecords(models::OStream auto &output,
+                  const std::vector<std::string> &files,
+                  const io::Settings &settings) {
+  using Key = typename I::key_type;
+  using Node = std::pair<Key, size_t>;
+
+  std::vector<I> inputs;
+  inputs.reserve(files.size());
+
+  std::priority_queue<Node, std::vector<Node>, std::greater<>> heap;
+  for (size_t ind = 0; ind != files.size(); ++ind) {
+    inputs.emplace_back(files[ind], settings);
+
+    if (!inputs.back().Eof()) {
+      heap.emplace(inputs.back().Key(), ind);
+    }
+  }
+
+  bool sorted = true;
+  Key prev = 0;
+
+  while (!heap.empty()) {
+    const auto [key, ind] = heap.top();
+    heap.pop();
+
+    sorted &= prev <= key;
+    prev = key;
+
+    inputs[ind].Emit(output);
+    if (!inputs[ind].Eof()) {
+      heap.emplace(inputs[ind].Key(), ind);
+    }
+  }
+
+  return sorted;
 }
 
 template <class T, class KeyF, models::IOStreams M_IO, models::OStream O>
 arrow::Status MergePass(const std::string &file_output, size_t last_file,
-                        const io::Settings &settings, KeyF key) {
+                        SpillSpace &spill, const io::Settings &settings,
+                        const io::Settings &output_settings, KeyF key) {
   using M_I = typename M_IO::input;
   using M_O = typename M_IO::output;
-  using Node = details::MergeHeapNode<T>;
 
-  const auto cmp = [&](const Node &lhs, const Node &rhs) {
-    return std::invoke(key, rhs.val) < std::invoke(key, lhs.val);
-  };
-  std::priority_queue<Node, std::vector<Node>, decltype(cmp)> heap(cmp);
+  auto heap = MakeMergeHeap<T>(key);
   size_t cur_file = 0;
 
-  while (cur_file != last_file) {
+  // a single run, as ordered input leaves, still has to reach the output
+  do {
     ++last_file;
     const size_t file_merge_up_to =
         std::min(cur_file + settings.batches_num, last_file);
 
+    std::vector<std::string> files;
+    for (size_t file_id = cur_file; file_id != file_merge_up_to; ++file_id) {
+      files.push_back(spill.Path(file_id));
+    }
+
+    const auto merge = [&](auto &output) {
+      if constexpr (models::RecordIStream<M_I>) {
+        MergeRecords<M_I>(output, files, settings);
+      } else {
+        Merge<T, M_I>(output, files, settings, heap, key);
+      }
+    };
+
     if (file_merge_up_to == last_file) {
-      Merge<T, M_I, O>(file_output, cur_file, file_merge_up_to, settings, heap);
+      O output(file_output, output_settings);
+      merge(output);
+      ARROW_RETURN_NOT_OK(models::CloseOutput(output));
     } else {
-      const auto filename = kTmpSortDir + std::to_string(last_file);
-      Merge<T, M_I, M_O>(filename, cur_file, file_merge_up_to, settings, heap);
+      auto output = OpenRun<M_O>(spill.Path(last_file), settings, key);
+      merge(output);
+      ARROW_RETURN_NOT_OK(models::CloseOutput(output));
     }
 
-    for (size_t file_id = cur_file; file_id != file_merge_up_to; ++file_id) {
-      std::filesystem::remove(kTmpSortDir + std::to_string(file_id));
+    for (const auto &filename : files) {
+      std::filesystem::remove(filename);
     }
 
     cur_file = file_merge_up_to;
-  }
+  } while (cur_file != last_file);
 
   return arrow::Status::OK();
 }
@@ -112,33 +184,67 @@ struct MergeStats {
 };
 
 template <class T, models::IStream I, models::IOStreams M_IO, models::OStream O,
-          class KeyF>
+          models::SortBuffer<T> Buffer>
 arrow::Result<MergeStats>
 MergeSort(const std::string &file_input, const std::string &file_output,
-          size_t batches_num, SortBuffer<T, KeyF> &buffer) {
+          size_t batches_num, Buffer &buffer, const SortOptions &options = {}) {
+  using KeyF = decltype(buffer.key);
   static_assert(models::Sortable<T, KeyF>);
 
   using M_O = typename M_IO::output;
 
   MergeStats result;
 
-  io::Settings settings(buffer.Size(), batches_num, sizeof(T), file_input);
-  I input(file_input, settings);
+  io::Settings settings(buffer.Size(), batches_num, sizeof(T), file_input, {},
+                        options.spill);
+  settings.Use(options.pool);
+  io::Settings output_settings(buffer.Size(), batches_num, sizeof(T),
+                               file_input, details::SortedOutput(options));
+  output_settings.Use(options.pool);
+  const std::string output_file = io::OutputFile(file_output);
+
+  // Part files that are each ordered by statistics are merged directly, a
+  // part that turns out not to be ordered sends the job to the regular path
+  const auto parts = io::ListInputFiles(file_input);
+  if (options.key_column && !options.predicate && parts.size() > 1 &&
+      parts.size() <= batches_num &&
+      std::all_of(parts.begin(), parts.end(), [&](const std::string &part) {
+        return io::SortedByStatistics(part, *options.key_column);
+      })) {
+    const auto begin = std::chrono::high_resolution_clock::now();
+
+    auto heap = details::MakeMergeHeap<T>(buffer.key);
+    bool sorted;
+    {
+      O output(output_file, output_settings);
+      sorted = details::Merge<T, I>(output, parts, settings, heap, buffer.key);
+      ARROW_RETURN_NOT_OK(models::CloseOutput(output));
+    }
+
+    result.fp_write += std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now() - begin);
+
+    if (sorted) {
+      return result;
+    }
+  }
+
+  ARROW_ASSIGN_OR_RAISE(I input,
+                        details::OpenInput<I>(file_input, settings, options));
 
   size_t last_ind;
 
   const auto read_block = [&] {
     const auto begin = std::chrono::high_resolution_clock::now();
 
-    for (last_ind = 0; last_ind != settings.total_rows && !input.Eof();
-         ++last_ind) {
-      input >> buffer[last_ind];
-    }
+    last_ind = buffer.Read(input, settings.total_rows);
 
     result.fp_read += std::chrono::duration_cast<std::chrono::milliseconds>(
         std::chrono::high_resolution_clock::now() - begin);
   };
 
+  // Sort finds blocks that arrived in key order in the same scan that looks
+  // for presorted runs
   const auto sort_block = [&] {
     const auto begin = std::chrono::high_resolution_clock::now();
 
@@ -151,45 +257,107 @@ MergeSort(const std::string &file_input, const std::string &file_output,
   const auto write_block = [&](auto &sorted_output) {
     const auto begin = std::chrono::high_resolution_clock::now();
 
-    for (size_t ind = 0; ind != last_ind; ++ind) {
-      sorted_output << buffer[ind];
-    }
+    buffer.Write(sorted_output, last_ind);
 
     result.fp_write += std::chrono::duration_cast<std::chrono::milliseconds>(
         std::chrono::high_resolution_clock::now() - begin);
   };
 
+  const auto block_min = [&] { return std::invoke(buffer.key, buffer[0]); };
+  const auto block_max = [&] {
+    return std::invoke(buffer.key, buffer[last_ind - 1]);
+  };
+
+  // Statistics say the input is ordered: stream it straight to the output,
+  // checking every block, and start over with a real sort if they lied
+  if (options.key_column &&
+      io::SortedByStatistics(file_input, *options.key_column)) {
+    bool sorted = true;
+    {
+      O output(output_file, output_settings);
+      models::SortKey<T, KeyF> prev_max = 0;
+
+      while (sorted && !input.Eof()) {
+        read_block();
+        if (last_ind == 0) {
+          break;
+        }
+
+        sorted = buffer.Sorted(last_ind) && prev_max <= block_min();
+        if (sorted) {
+          prev_max = block_max();
+          write_block(output);
+        }
+      }
+      ARROW_RETURN_NOT_OK(models::CloseOutput(output));
+    }
+
+    if (sorted) {
+      return result;
+    }
+
+    ARROW_ASSIGN_OR_RAISE(input,
+                          details::OpenInput<I>(file_input, settings, options));
+  }
+
   read_block();
   sort_block();
 
   if (input.Eof()) {
-    auto output = O(file_output, settings);
+    auto output = O(output_file, output_settings);
     write_block(output);
+    ARROW_RETURN_NOT_OK(models::CloseOutput(output));
 
     return result;
   }
 
-  std::filesystem::create_directory(kTmpSortDir);
+  SpillSpace spill(options);
+  spill.Create();
   size_t last_file = 0;
 
-  for (;;) {
-    M_O output(kTmpSortDir + std::to_string(last_file), settings);
+  // blocks that continue the order of the current run are appended to it
+  // instead of starting a new one
+  {
+    auto output =
+        details::OpenRun<M_O>(spill.Path(last_file), settings, buffer.key);
+    auto run_max = block_max();
     write_block(output);
 
-    if (input.Eof()) {
-      break;
+    while (!input.Eof()) {
+      read_block();
+      if (last_ind == 0) {
+        break;
+      }
+      sort_block();
+
+      if (block_min() < run_max) {
+        ARROW_RETURN_NOT_OK(models::CloseOutput(output));
+        ++last_file;
+        output =
+            details::OpenRun<M_O>(spill.Path(last_file), settings, buffer.key);
+      }
+      run_max = block_max();
+      write_block(output);
     }
+    ARROW_RETURN_NOT_OK(models::CloseOutput(output));
+  }
 
-    ++last_file;
-    read_block();
-    sort_block();
+  // rows of the buffer are dead once the last run is written, so the buffers
+  // of the merge are carved out of their memory rather than allocated anew
+  std::optional<io::BufferPool> lent;
+  io::Settings merge_settings = settings;
+  if constexpr (requires { buffer.Storage(); }) {
+    const auto storage = buffer.Storage();
+    lent.emplace(storage.data(), storage.size(), options.pool);
+    merge_settings.pool = &*lent;
   }
 
   const auto status = details::MergePass<T, KeyF, M_IO, O>(
-      file_output, last_file, settings, buffer.key);
+      output_file, last_file, spill, merge_settings, output_settings,
+      buffer.key);
   ARROW_RETURN_NOT_OK(status);
 
-  std::filesystem::remove_all(kTmpSortDir);
+  spill.Remove();
 
   return result;
 }
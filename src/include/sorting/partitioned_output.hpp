@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <io/settings.hpp>
+#include <models/io_stream.hpp>
+#include <models/sortable.hpp>
+#include <sorting/bucket_split.hpp>
+
+namespace sorting {
+
+const std::string kPartitionManifest = "_manifest";
+
+namespace details {
+
+// Adds `status` to `errors`: the first error is kept, the messages of later
+// ones are appended to it
+inline void CollectStatus(arrow::Status &errors, const arrow::Status &status) {
+  if (status.ok()) {
+    return;
+  }
+  errors = errors.ok() ? status
+                       : errors.WithMessage(errors.message() + "; " +
+                                            status.message());
+}
+
+} // namespace details
+
+// Writes rows arriving in key order into `partitions` range partitioned files
+// part-<i>.parquet of the output directory. Partition boundaries are taken
+// from a sample of keys via SampleSplitter, so partitions come out about
+// equal in size, and listed in a _manifest file: a key belongs to the first
+// partition whose max key is not below it. A single partition is written to
+// `path` itself with no manifest. Close reports the errors of every
+// partition, a stream destroyed without it leaves the partitions after the
+// current one unwritten.
+template <class T, models::OStream O, class KeyF> class PartitionedOStream {
+  using Key = models::SortKey<T, KeyF>;
+
+public:
+  using type = T;
+
+  PartitionedOStream(const std::string &path,
+                     const io::ParquetSettings &settings, KeyF key,
+                     size_t partitions)
+      : key(key), path_(path), settings_(settings), partitions_(partitions) {
+    if (partitions_ <= 1) {
+      output_ = O(io::OutputFile(path_), settings_);
+    } else {
+      std::filesystem::create_directories(path_);
+    }
+  }
+
+  PartitionedOStream(const PartitionedOStream &) = delete;
+
+  // Opens the partitions nothing fell into and finishes the last one,
+  // returns the errors of every partition, see models::CloseOutput
+  arrow::Status Close() {
+    details::CollectStatus(status_, OpenRemaining());
+    details::CollectStatus(status_, models::CloseOutput(output_));
+    return status_;
+  }
+
+  // Fixes boundaries from `samples`, must be called before the first write
+  // if there is more than one partition
+  void Partition(std::vector<Key> samples, Key min, Key max) {
+    if (partitions_ <= 1) {
+      return;
+    }
+
+    if (samples.size() < partitions_) {
+      samples.resize(partitions_, samples.empty() ? min : samples.back());
+    }
+    SampleSplitter<Key> splitter(std::move(samples), min, max, partitions_);
+
+    std::ofstream manifest(std::filesystem::path(path_) / kPartitionManifest);
+    manifest << "# file max_key\n";
+    for (size_t ind = 0; ind != partitions_; ++ind) {
+      bounds_.push_back(splitter.Max(ind));
+      manifest << PartName(ind) << ' '
+               << static_cast<uint64_t>(bounds_.back()) << '\n';
+    }
+
+    details::CollectStatus(status_, Open(0));
+  }
+
+  PartitionedOStream &operator<<(const T &row) {
+    details::CollectStatus(status_, Route(std::invoke(key, row)));
+    output_ << row;
+    return *this;
+  }
+
+  void Write(const T *rows, size_t count) {
+    while (count) {
+      details::CollectStatus(status_, Route(std::invoke(key, rows[0])));
+
+      size_t step = count;
+      if (Partitioned()) {
+        const Key bound = bounds_[current_];
+        step = std::partition_point(rows, rows + count,
+                                    [&](const T &row) {
+                                      return std::invoke(key, row) <= bound;
+                                    }) -
+               rows;
+        step = std::max<size_t>(step, 1);
+      }
+
+      if constexpr (requires { output_.Write(rows, step); }) {
+        output_.Write(rows, step);
+      } else {
+        for (size_t ind = 0; ind != step; ++ind) {
+          output_ << rows[ind];
+        }
+      }
+      rows += step;
+      count -= step;
+    }
+  }
+
+private:
+  bool Partitioned() const { return !bounds_.empty(); }
+
+  // partitions nothing fell into still get an empty file
+  arrow::Status OpenRemaining() {
+    arrow::Status status;
+    while (Partitioned() && current_ + 1 < partitions_) {
+      details::CollectStatus(status, Open(current_ + 1));
+    }
+    return status;
+  }
+
+  static std::string PartName(size_t ind) {
+    return "part-" + std::to_string(ind) + ".parquet";
+  }
+
+  // Finishes the current partition and starts partition `ind`, returns
+  // the errors of the finished one
+  arrow::Status Open(size_t ind) {
+    const arrow::Status status = models::CloseOutput(output_);
+    current_ = ind;
+    output_ = O((std::filesystem::path(path_) / PartName(ind)).string(),
+                settings_);
+    return status;
+  }
+
+  // Rows arrive in key order, so the current partition only moves forward
+  arrow::Status Route(Key row_key) {
+    arrow::Status status;
+    if (!Partitioned()) {
+      return status;
+    }
+
+    size_t ind = current_;
+    while (ind + 1 < partitions_ && bounds_[ind] < row_key) {
+      ++ind;
+    }
+    if (ind != current_) {
+      // skipped partitions still get an empty file
+      for (size_t empty = current_ + 1; empty != ind; ++empty) {
+        details::CollectStatus(status, Open(empty));
+      }
+      details::CollectStatus(status, Open(ind));
+    }
+    return status;
+  }
+
+public:
+  KeyF key;
+
+private:
+  std::string path_;
+  io::ParquetSettings settings_;
+  size_t partitions_;
+
+  std::vector<Key> bounds_;
+  size_t current_ = 0;
+  O output_;
+  arrow::Status status_;
+};
+
+} // namespace sorting
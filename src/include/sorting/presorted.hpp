@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <span>
+#include <utility>
+
+namespace sorting {
+
+namespace details {
+
+// Blocks are often ascending, descending or a few sorted runs one after
+// another (time series, concatenated sorted files). One scan splits a block
+// into maximal runs and gives up once there are too many, which on random
+// keys happens within a few dozen rows, so the scan is nearly free when it
+// does not pay off.
+
+// Merging r runs moves every row about log2(r) times, with more runs a
+// radix sort is cheaper
+inline constexpr size_t kMaxPresortedRuns = 16;
+
+struct PresortedRun {
+  size_t from;
+  size_t to;
+  bool descending;
+};
+
+using PresortedRuns = std::array<PresortedRun, kMaxPresortedRuns>;
+
+// Splits data[0, size) into non-descending and non-ascending runs, returns
+// their number or 0 if there are more than kMaxPresortedRuns
+template <class T, class KeyF>
+size_t FindRuns(const T *data, size_t size, KeyF key, PresortedRuns &runs) {
+  size_t runs_num = 0;
+  for (size_t from = 0; from != size;) {
+    if (runs_num == runs.size()) {
+      return 0;
+    }
+
+    // equal keys fit either direction, the first different one decides
+    auto prev = std::invoke(key, data[from]);
+    size_t to = from + 1;
+    while (to != size && std::invoke(key, data[to]) == prev) {
+      ++to;
+    }
+    const bool descending = to != size && std::invoke(key, data[to]) < prev;
+
+    for (; to != size; ++to) {
+      const auto next = std::invoke(key, data[to]);
+      if (descending ? prev < next : next < prev) {
+        break;
+      }
+      prev = next;
+    }
+
+    runs[runs_num++] = {from, to, descending};
+    from = to;
+  }
+  return runs_num;
+}
+
+// Powersort priority of merging [from, mid) with [mid, to) in a block of
+// `size` rows: the first bit in which the run midpoints, as fractions of
+// the block, differ
+inline unsigned MergePower(size_t size, size_t from, size_t mid, size_t to) {
+  // twice the midpoints
+  size_t lhs = from + mid;
+  size_t rhs = mid + to;
+
+  unsigned power = 0;
+  for (;;) {
+    ++power;
+    if (lhs >= size) {
+      lhs -= size;
+      rhs -= size;
+    } else if (rhs >= size) {
+      return power;
+    }
+    lhs <<= 1;
+    rhs <<= 1;
+  }
+}
+
+// Stable merge of the sorted runs [from, mid) and [mid, to) through `extra`,
+// which holds at least the shorter of them. Rows already in place at either
+// end are not moved.
+template <class T, class KeyF>
+void MergeAdjacent(T *data, size_t from, size_t mid, size_t to, T *extra,
+                   KeyF key) {
+  const auto less = [&](const T &lhs, const T &rhs) {
+    return std::invoke(key, lhs) < std::invoke(key, rhs);
+  };
+
+  from = std::upper_bound(data + from, data + mid, data[mid], less) - data;
+  to = std::lower_bound(data + mid, data + to, data[mid - 1], less) - data;
+  if (from == mid || mid == to) {
+    return;
+  }
+
+  if (mid - from <= to - mid) {
+    T *lhs = extra;
+    T *lhs_end = std::move(data + from, data + mid, extra);
+    T *rhs = data + mid;
+    T *out = data + from;
+    while (lhs != lhs_end && rhs != data + to) {
+      *out++ = less(*rhs, *lhs) ? std::move(*rhs++) : std::move(*lhs++);
+    }
+    std::move(lhs, lhs_end, out);
+  } else {
+    T *lhs = data + mid;
+    T *rhs = std::move(data + mid, data + to, extra);
+    T *out = data + to;
+    while (lhs != data + from && rhs != extra) {
+      *--out = less(rhs[-1], lhs[-1]) ? std::move(*--lhs) : std::move(*--rhs);
+    }
+    std::move_backward(extra, rhs, out);
+  }
+}
+
+// Sorts data[0, size) in about one pass if it is ascending, descending or
+// made of at most kMaxPresortedRuns runs, merged powersort style through
+// `extra` (half the block is enough). Returns false without touching the
+// rows otherwise. Not stable, descending runs are reversed.
+template <class T, class KeyF>
+bool SortPresorted(T *data, size_t size, std::span<T> extra, KeyF key) {
+  if (size < 2) {
+    return true;
+  }
+
+  PresortedRuns runs;
+  const size_t runs_num = FindRuns(data, size, key, runs);
+  if (runs_num == 0 || (runs_num > 1 && extra.size() < size / 2)) {
+    return false;
+  }
+
+  for (size_t ind = 0; ind != runs_num; ++ind) {
+    if (runs[ind].descending) {
+      std::reverse(data + runs[ind].from, data + runs[ind].to);
+    }
+  }
+
+  // runs waiting for a merge, each ends where the next one starts
+  struct Pending {
+    size_t from;
+    unsigned power;
+  };
+  std::array<Pending, kMaxPresortedRuns> stack;
+  size_t depth = 0;
+
+  size_t from = 0;
+  size_t to = runs[0].to;
+  for (size_t ind = 1; ind != runs_num; ++ind) {
+    const unsigned power = MergePower(size, from, to, runs[ind].to);
+    while (depth != 0 && stack[depth - 1].power > power) {
+      MergeAdjacent(data, stack[depth - 1].from, from, to, extra.data(), key);
+      from = stack[--depth].from;
+    }
+    stack[depth++] = {from, power};
+    from = to;
+    to = runs[ind].to;
+  }
+
+  while (depth != 0) {
+    MergeAdjacent(data, stack[depth - 1].from, from, to, extra.data(), key);
+    from = stack[--depth].from;
+  }
+  return true;
+}
+
+} // namespace details
+
+} // namespace sorting
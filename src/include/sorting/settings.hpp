@@ -1,9 +1,89 @@
 #pragma once
 
+#include <optional>
 #include <string>
+#include <type_traits>
+#include <vector>
+
+#include <arrow/api.h>
+
+#include <io/settings.hpp>
 
 namespace sorting {
 
 const std::string kTmpSortDir = ".tmp_sort/";
 
+// How spill files are spread over spill directories
+enum class Striping {
+  kRoundRobin,
+  // directories get files in proportion to their free space
+  kFreeSpace,
+};
+
+// Per job options of the sort entry points
+struct SortOptions {
+  // rows outside the range are dropped while reading the input
+  std::optional<io::RangePredicate> predicate;
+  // parquet column the key is taken from, lets the sort trust row group
+  // statistics of already ordered input
+  std::optional<std::string> key_column;
+  // number of range partitioned output files, see PartitionedOStream
+  size_t partitions = 1;
+  // layout of the sorted output
+  io::OutputOptions output;
+  // compression and read ahead of binary spill runs
+  io::SpillOptions spill;
+  // spill directories, one per device, runs and buckets are striped over
+  // them, see SpillSpace
+  std::vector<std::string> spill_dirs = {kTmpSortDir};
+  Striping striping = Striping::kRoundRobin;
+  // memory manager of the job, spill buffers and Arrow allocations come out
+  // of it, see io::BufferPool
+  io::BufferPool *pool = nullptr;
+};
+
+namespace details {
+
+// Output layout of a job, the key column is recorded as the sort order unless
+// another column is given
+inline io::OutputOptions SortedOutput(const SortOptions &options) {
+  io::OutputOptions output = options.output;
+  if (!output.sorted_by) {
+    output.sorted_by = options.key_column;
+  }
+  return output;
+}
+
+// Opens a spill run, streams that prefix rows with their key also get the key
+// function
+template <class O, class KeyF>
+O OpenRun(const std::string &filename, const io::Settings &settings, KeyF key) {
+  if constexpr (std::is_constructible_v<O, const std::string &,
+                                        const io::Settings &, KeyF>) {
+    return O(filename, settings, key);
+  } else {
+    return O(filename, settings);
+  }
+}
+
+template <class I>
+arrow::Result<I> OpenInput(const std::string &file_input,
+                           const io::Settings &settings,
+                           const SortOptions &options) {
+  if (!options.predicate) {
+    return I(file_input, settings);
+  }
+
+  if constexpr (std::is_constructible_v<I, const std::string &,
+                                        const io::Settings &,
+                                        const io::RangePredicate &>) {
+    return I(file_input, settings, *options.predicate);
+  } else {
+    return arrow::Status::NotImplemented(
+        "input stream does not support predicates");
+  }
+}
+
+} // namespace details
+
 } // namespace sorting
@@ -0,0 +1,198 @@
+#pragma once
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace sorting {
+
+namespace details {
+
+// Keys are sorted together with the indices of their rows (structure of
+// arrays), so the rows themselves move once, after the keys are in order.
+// Every compare-exchange and merge step is branchless, random keys make
+// branches of a comparison sort mispredict half the time.
+
+template <class KeyT>
+inline void CompareExchange(KeyT *keys, size_t *inds, size_t lhs, size_t rhs) {
+  const KeyT lhs_key = keys[lhs];
+  const KeyT rhs_key = keys[rhs];
+  const size_t lhs_ind = inds[lhs];
+  const size_t rhs_ind = inds[rhs];
+
+  const bool swap = rhs_key < lhs_key;
+  keys[lhs] = swap ? rhs_key : lhs_key;
+  keys[rhs] = swap ? lhs_key : rhs_key;
+  inds[lhs] = swap ? rhs_ind : lhs_ind;
+  inds[rhs] = swap ? lhs_ind : rhs_ind;
+}
+
+// The AVX2 kernel is built for every x86-64 target and picked at runtime,
+// the default build does not enable AVX2
+inline bool HasAvx2() {
+#if defined(__x86_64__)
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) inline void
+CompareExchange(__m256i &lhs_keys, __m256i &rhs_keys, __m256i &lhs_inds,
+                __m256i &rhs_inds) {
+  // unsigned compare through the signed one
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i swap =
+      _mm256_cmpgt_epi64(_mm256_xor_si256(lhs_keys, sign),
+                         _mm256_xor_si256(rhs_keys, sign));
+
+  const __m256i keys = _mm256_blendv_epi8(lhs_keys, rhs_keys, swap);
+  rhs_keys = _mm256_blendv_epi8(rhs_keys, lhs_keys, swap);
+  lhs_keys = keys;
+
+  const __m256i inds = _mm256_blendv_epi8(lhs_inds, rhs_inds, swap);
+  rhs_inds = _mm256_blendv_epi8(rhs_inds, lhs_inds, swap);
+  lhs_inds = inds;
+}
+
+__attribute__((target("avx2"))) inline void
+Transpose(__m256i &row0, __m256i &row1, __m256i &row2, __m256i &row3) {
+  const __m256i lo01 = _mm256_unpacklo_epi64(row0, row1);
+  const __m256i hi01 = _mm256_unpackhi_epi64(row0, row1);
+  const __m256i lo23 = _mm256_unpacklo_epi64(row2, row3);
+  const __m256i hi23 = _mm256_unpackhi_epi64(row2, row3);
+
+  row0 = _mm256_permute2x128_si256(lo01, lo23, 0x20);
+  row1 = _mm256_permute2x128_si256(hi01, hi23, 0x20);
+  row2 = _mm256_permute2x128_si256(lo01, lo23, 0x31);
+  row3 = _mm256_permute2x128_si256(hi01, hi23, 0x31);
+}
+
+// Sorts 16 keys into four runs of four: the network runs across registers,
+// sorting the columns, and the transpose turns columns into runs
+__attribute__((target("avx2"))) inline void SortRuns16(uint64_t *keys,
+                                                       size_t *inds) {
+  auto *key_vecs = reinterpret_cast<__m256i *>(keys);
+  auto *ind_vecs = reinterpret_cast<__m256i *>(inds);
+
+  __m256i k0 = _mm256_loadu_si256(key_vecs);
+  __m256i k1 = _mm256_loadu_si256(key_vecs + 1);
+  __m256i k2 = _mm256_loadu_si256(key_vecs + 2);
+  __m256i k3 = _mm256_loadu_si256(key_vecs + 3);
+  __m256i i0 = _mm256_loadu_si256(ind_vecs);
+  __m256i i1 = _mm256_loadu_si256(ind_vecs + 1);
+  __m256i i2 = _mm256_loadu_si256(ind_vecs + 2);
+  __m256i i3 = _mm256_loadu_si256(ind_vecs + 3);
+
+  CompareExchange(k0, k1, i0, i1);
+  CompareExchange(k2, k3, i2, i3);
+  CompareExchange(k0, k2, i0, i2);
+  CompareExchange(k1, k3, i1, i3);
+  CompareExchange(k1, k2, i1, i2);
+
+  Transpose(k0, k1, k2, k3);
+  Transpose(i0, i1, i2, i3);
+
+  _mm256_storeu_si256(key_vecs, k0);
+  _mm256_storeu_si256(key_vecs + 1, k1);
+  _mm256_storeu_si256(key_vecs + 2, k2);
+  _mm256_storeu_si256(key_vecs + 3, k3);
+  _mm256_storeu_si256(ind_vecs, i0);
+  _mm256_storeu_si256(ind_vecs + 1, i1);
+  _mm256_storeu_si256(ind_vecs + 2, i2);
+  _mm256_storeu_si256(ind_vecs + 3, i3);
+}
+#endif
+
+// Sorts every run of four with the optimal five comparator network, 64-bit
+// keys sixteen at a time with `avx2`, a short tail by insertion
+template <class KeyT>
+void SortRuns(KeyT *keys, size_t *inds, size_t size,
+              [[maybe_unused]] bool avx2) {
+  size_t from = 0;
+
+#if defined(__x86_64__)
+  if constexpr (sizeof(KeyT) == sizeof(uint64_t)) {
+    for (; avx2 && from + 16 <= size; from += 16) {
+      SortRuns16(reinterpret_cast<uint64_t *>(keys + from), inds + from);
+    }
+  }
+#endif
+
+  for (; from + 4 <= size; from += 4) {
+    CompareExchange(keys, inds, from, from + 1);
+    CompareExchange(keys, inds, from + 2, from + 3);
+    CompareExchange(keys, inds, from, from + 2);
+    CompareExchange(keys, inds, from + 1, from + 3);
+    CompareExchange(keys, inds, from + 1, from + 2);
+  }
+
+  for (size_t ind = from + 1; ind < size; ++ind) {
+    for (size_t pos = ind; pos != from && keys[pos] < keys[pos - 1]; --pos) {
+      std::swap(keys[pos], keys[pos - 1]);
+      std::swap(inds[pos], inds[pos - 1]);
+    }
+  }
+}
+
+// Merges the sorted runs [from, mid) and [mid, to) into out_*
+template <class KeyT>
+void MergeRuns(const KeyT *keys, const size_t *inds, size_t from, size_t mid,
+               size_t to, KeyT *out_keys, size_t *out_inds) {
+  size_t lhs = from;
+  size_t rhs = mid;
+  size_t out = from;
+
+  while (lhs != mid && rhs != to) {
+    const bool take_rhs = keys[rhs] < keys[lhs];
+    out_keys[out] = take_rhs ? keys[rhs] : keys[lhs];
+    out_inds[out] = take_rhs ? inds[rhs] : inds[lhs];
+    rhs += take_rhs;
+    lhs += !take_rhs;
+    ++out;
+  }
+
+  std::copy(keys + lhs, keys + mid, out_keys + out);
+  std::copy(inds + lhs, inds + mid, out_inds + out);
+  out += mid - lhs;
+  std::copy(keys + rhs, keys + to, out_keys + out);
+  std::copy(inds + rhs, inds + to, out_inds + out);
+}
+
+// Sorts keys[0, size) carrying inds along, extra_* are scratch of the same
+// size. Not stable.
+template <class KeyT>
+void SortPairs(KeyT *keys, size_t *inds, KeyT *extra_keys, size_t *extra_inds,
+               size_t size, bool avx2 = HasAvx2()) {
+  SortRuns(keys, inds, size, avx2);
+
+  bool in_extra = false;
+  for (size_t width = 4; width < size; width *= 2) {
+    const KeyT *from_keys = in_extra ? extra_keys : keys;
+    const size_t *from_inds = in_extra ? extra_inds : inds;
+    KeyT *to_keys = in_extra ? keys : extra_keys;
+    size_t *to_inds = in_extra ? inds : extra_inds;
+
+    for (size_t from = 0; from < size; from += 2 * width) {
+      const size_t mid = std::min(from + width, size);
+      const size_t to = std::min(from + 2 * width, size);
+      MergeRuns(from_keys, from_inds, from, mid, to, to_keys, to_inds);
+    }
+    in_extra ^= true;
+  }
+
+  if (in_extra) {
+    std::memcpy(keys, extra_keys, size * sizeof(KeyT));
+    std::memcpy(inds, extra_inds, size * sizeof(size_t));
+  }
+}
+
+} // namespace details
+
+} // namespace sorting
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <io/literals.hpp>
+
+namespace sorting {
+
+enum class PageSize {
+  kDefault,
+  // madvise(MADV_HUGEPAGE), the kernel backs the buffer when it can
+  kTransparentHuge,
+  // MAP_HUGETLB from the reserved pool, transparent ones if it is empty
+  kHuge,
+};
+
+enum class Placement {
+  // pages land on the node of the thread that writes them first
+  kFirstTouch,
+  // pages are spread round robin over all NUMA nodes
+  kInterleave,
+  // slice `i` of the buffer is touched by worker `i`, see ForEachSlice
+  kLocal,
+};
+
+// Allocation of the vectors of a sort buffer, multi GiB buffers that are
+// scattered into at random are TLB bound on 4 KiB pages
+struct MemoryOptions {
+  PageSize pages = PageSize::kDefault;
+  Placement placement = Placement::kFirstTouch;
+  // threads touching a mapped buffer and applying permutations, the
+  // calling thread alone by default, all hardware threads if 0
+  size_t workers = 1;
+  // buffers that sort indices keep a second array of rows, permutations
+  // are then gathered into it on all workers instead of followed cycle by
+  // cycle in place, at the cost of twice the row memory
+  bool scratch_rows = false;
+
+  bool Mapped() const {
+    return pages != PageSize::kDefault || placement != Placement::kFirstTouch;
+  }
+
+  size_t Workers() const {
+    return workers ? workers
+                   : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  }
+
+  // Workers are pinned only when they place the pages, pinning shares of
+  // an ordinary buffer would just crowd the CPUs other threads run on
+  bool Pinned() const { return placement == Placement::kLocal; }
+};
+
+namespace details {
+
+// CPUs the process may run on, worker `i` is pinned to the i-th of them
+inline const std::vector<int> &AllowedCpus() {
+  static const std::vector<int> cpus = [] {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int cpu = 0; cpu != CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+    return cpus;
+  }();
+  return cpus;
+}
+
+// Runs `func(worker, from, to)` over `workers` equal slices of [0, size),
+// with `pin` on threads pinned to a CPU each, so a pass over slice `i` runs
+// on the CPU that first touched it
+template <class F>
+void ForEachSlice(size_t size, size_t workers, bool pin, F func) {
+  workers = std::clamp<size_t>(workers, 1, std::max<size_t>(size, 1));
+  if (workers == 1) {
+    func(size_t{0}, size_t{0}, size);
+    return;
+  }
+
+  const auto &cpus = AllowedCpus();
+  std::vector<std::thread> threads;
+  for (size_t worker = 0; worker != workers; ++worker) {
+    threads.emplace_back([&, worker] {
+      if (pin && !cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[worker % cpus.size()], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      }
+      func(worker, size * worker / workers, size * (worker + 1) / workers);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// Interleaves [ptr, ptr + size) over the online NUMA nodes, a no-op on
+// machines with a single node
+inline void Interleave(void *ptr, size_t size) {
+  static constexpr int kInterleave = 3; // MPOL_INTERLEAVE
+
+  std::ifstream online("/sys/devices/system/node/online");
+  std::string nodes;
+  if (!(online >> nodes)) {
+    return;
+  }
+
+  // "0-3,5"
+  unsigned long mask = 0;
+  for (size_t pos = 0; pos < nodes.size();) {
+    size_t end = nodes.find(',', pos);
+    end = end == std::string::npos ? nodes.size() : end;
+    const std::string range = nodes.substr(pos, end - pos);
+    const size_t dash = range.find('-');
+    const int first = std::stoi(range.substr(0, dash));
+    const int last =
+        dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int node = first; node <= last && node < 64; ++node) {
+      mask |= 1ul << node;
+    }
+    pos = end + 1;
+  }
+
+  if (mask & (mask - 1)) {
+    syscall(SYS_mbind, ptr, size, kInterleave, &mask, 64, 0);
+  }
+}
+
+} // namespace details
+
+// Allocator of sort buffer vectors. Elements are default initialized, so
+// the pages of a mapped buffer stay where the workers placed them.
+template <class T> class SortAllocator {
+  static constexpr size_t kPage = 4096;
+  static constexpr size_t kHugePage = 2_MiB;
+
+public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  SortAllocator() = default;
+  explicit SortAllocator(const MemoryOptions &options) : options_(options) {}
+
+  template <class U>
+  SortAllocator(const SortAllocator<U> &other) : options_(other.Options()) {}
+
+  const MemoryOptions &Options() const { return options_; }
+
+  T *allocate(size_t count) {
+    if (!options_.Mapped()) {
+      return std::allocator<T>().allocate(count);
+    }
+
+    const size_t size = Round(count * sizeof(T));
+    void *ptr = MAP_FAILED;
+    if (options_.pages == PageSize::kHuge) {
+      ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (ptr == MAP_FAILED) {
+      ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ptr == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      if (options_.pages != PageSize::kDefault) {
+        madvise(ptr, size, MADV_HUGEPAGE);
+      }
+    }
+
+    if (options_.placement == Placement::kInterleave) {
+      details::Interleave(ptr, size);
+    }
+    if (options_.placement != Placement::kFirstTouch) {
+      Touch(static_cast<char *>(ptr), size);
+    }
+
+    return static_cast<T *>(ptr);
+  }
+
+  void deallocate(T *ptr, size_t count) {
+    if (!options_.Mapped()) {
+      std::allocator<T>().deallocate(ptr, count);
+    } else {
+      munmap(ptr, Round(count * sizeof(T)));
+    }
+  }
+
+  template <class U>
+  void construct(U *ptr) noexcept(std::is_nothrow_default_constructible_v<U>) {
+    ::new (static_cast<void *>(ptr)) U;
+  }
+
+  template <class U, class... Args> void construct(U *ptr, Args &&...args) {
+    ::new (static_cast<void *>(ptr)) U(std::forward<Args>(args)...);
+  }
+
+  template <class U> bool operator==(const SortAllocator<U> &other) const {
+    return options_.pages == other.Options().pages &&
+           options_.placement == other.Options().placement;
+  }
+
+private:
+  size_t Round(size_t size) const {
+    const size_t page =
+        options_.pages == PageSize::kDefault ? kPage : kHugePage;
+    return (std::max<size_t>(size, 1) + page - 1) / page * page;
+  }
+
+  // Faults the pages in parallel, slice by slice
+  void Touch(char *ptr, size_t size) const {
+    const size_t pages = size / kPage;
+    details::ForEachSlice(pages, options_.Workers(), options_.Pinned(),
+                          [&](size_t, size_t from, size_t to) {
+                            for (size_t page = from; page != to; ++page) {
+                              static_cast<volatile char *>(ptr)[page * kPage] =
+                                  0;
+                            }
+                          });
+  }
+
+private:
+  MemoryOptions options_;
+};
+
+template <class T> using SortVector = std::vector<T, SortAllocator<T>>;
+
+} // namespace sorting
@@ -1,84 +1,236 @@
 #pragma once
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 #include <algorithm>
 #include <bit>
 #include <chrono>
 #include <concepts>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <limits>
 #include <numeric>
+#include <span>
+#include <tuple>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
+#include <io/arena.hpp>
+#include <sorting/presorted.hpp>
+#include <sorting/small_sort.hpp>
+#include <sorting/sort_allocator.hpp>
+
 namespace sorting {
 
 namespace details {
 
+inline constexpr size_t kCacheLine = 64;
+
+// Writes a staged cache line to memory past the caches
+inline void StreamLine(void *dst, const void *src) {
+#if defined(__AVX__)
+  for (size_t ind = 0; ind != kCacheLine / sizeof(__m256i); ++ind) {
+    _mm256_stream_si256(static_cast<__m256i *>(dst) + ind,
+                        _mm256_load_si256(static_cast<const __m256i *>(src) +
+                                          ind));
+  }
+#elif defined(__SSE2__)
+  for (size_t ind = 0; ind != kCacheLine / sizeof(__m128i); ++ind) {
+    _mm_stream_si128(static_cast<__m128i *>(dst) + ind,
+                     _mm_load_si128(static_cast<const __m128i *>(src) + ind));
+  }
+#else
+  std::memcpy(dst, src, kCacheLine);
+#endif
+}
+
+inline void StreamFence() {
+#if defined(__SSE2__)
+  _mm_sfence();
+#endif
+}
+
+// Moves vec[from, to) to extra, element `ind` to cntrs[get_bucket(ind)]++.
+// Elements that tile a cache line are staged per bucket and written a whole
+// line at a time with streaming stores, so the scatter neither reads the
+// destination lines in nor evicts the source from the caches.
+template <size_t kBuckets, class T, class GetBucket>
+void Scatter(T *vec, T *extra, size_t from, size_t to, size_t *cntrs,
+             GetBucket get_bucket) {
+  static constexpr size_t kPrefetch = 16;
+
+  constexpr bool kStaged = std::is_trivially_copyable_v<T> &&
+                           kCacheLine % sizeof(T) == 0 &&
+                           sizeof(T) * 2 <= kCacheLine;
+  if constexpr (kStaged) {
+    static constexpr size_t kPerLine = kCacheLine / sizeof(T);
+
+    const auto base = reinterpret_cast<uintptr_t>(extra);
+    if (to - from >= kBuckets * kPerLine && base % sizeof(T) == 0) {
+      struct alignas(kCacheLine) Line {
+        T rows[kPerLine];
+      };
+      static thread_local Line lines[kBuckets];
+
+      // lines are staged from the slot their destination starts at, the
+      // first line of a bucket is shared with the previous one
+      char *dsts[kBuckets];
+      size_t fills[kBuckets];
+      size_t starts[kBuckets];
+      for (size_t bucket = 0; bucket != kBuckets; ++bucket) {
+        const uintptr_t dst = base + cntrs[bucket] * sizeof(T);
+        starts[bucket] = fills[bucket] = dst % kCacheLine / sizeof(T);
+        dsts[bucket] = reinterpret_cast<char *>(dst - dst % kCacheLine);
+      }
+
+      const auto flush = [&](size_t bucket) {
+        const size_t start = starts[bucket];
+        char *dst = dsts[bucket] + start * sizeof(T);
+        const T *src = lines[bucket].rows + start;
+        if (start == 0 && fills[bucket] == kPerLine) {
+          StreamLine(dst, src);
+        } else {
+          std::memcpy(dst, src, (fills[bucket] - start) * sizeof(T));
+        }
+      };
+
+      for (size_t ind = from; ind != to; ++ind) {
+        if (ind + kPrefetch < to) {
+          __builtin_prefetch(&vec[ind + kPrefetch]);
+        }
+
+        const size_t bucket = get_bucket(vec[ind]);
+        ++cntrs[bucket];
+        lines[bucket].rows[fills[bucket]++] = vec[ind];
+
+        if (fills[bucket] == kPerLine) {
+          flush(bucket);
+          dsts[bucket] += kCacheLine;
+          starts[bucket] = fills[bucket] = 0;
+        }
+      }
+
+      for (size_t bucket = 0; bucket != kBuckets; ++bucket) {
+        if (fills[bucket] != starts[bucket]) {
+          flush(bucket);
+        }
+      }
+      StreamFence();
+      return;
+    }
+  }
+
+  for (size_t ind = from; ind != to; ++ind) {
+    auto &cntr = cntrs[get_bucket(vec[ind])];
+    extra[cntr] = std::move(vec[ind]);
+    ++cntr;
+  }
+}
+
 template <size_t BitsPerIter, class T, class KeyF,
           std::unsigned_integral KeyT = std::invoke_result_t<KeyF, const T &>>
-void LSDRadixSort(std::vector<T> &vec, std::vector<T> &extra, size_t size,
-                  KeyT min, KeyT max, KeyF key) {
-  static_assert(BitsPerIter != 0 && BitsPerIter < sizeof(KeyF) * 8);
+void LSDRadixSort(T *vec, T *extra, size_t size, KeyT min, KeyT max,
+                  KeyF key) {
+  static_assert(BitsPerIter != 0 && BitsPerIter < sizeof(KeyT) * 8);
   static constexpr size_t kBuckets = 1ull << BitsPerIter;
   static constexpr size_t kMask = kBuckets - 1;
 
-  const size_t max_bit = sizeof(KeyT) * 8 - std::countl_zero(max - min);
+  const size_t max_bit = sizeof(KeyT) * 8 - std::countl_zero<KeyT>(max - min);
+  const size_t passes = (max_bit + BitsPerIter - 1) / BitsPerIter;
 
   const auto get_bucket = [key, min](const T &el, size_t bit) {
     return ((std::invoke(key, el) - min) >> bit) & kMask;
   };
 
-  // TODO: use ptr instead of index
+  // histograms of every digit in one sweep, each key is read once
+  std::vector<size_t> cntrs(passes * kBuckets);
+  for (size_t ind = 0; ind != size; ++ind) {
+    const KeyT value = std::invoke(key, vec[ind]) - min;
+    for (size_t pass = 0; pass != passes; ++pass) {
+      ++cntrs[pass * kBuckets + ((value >> (pass * BitsPerIter)) & kMask)];
+    }
+  }
 
   bool swapped = false;
-  for (size_t bit = 0; bit < max_bit; bit += BitsPerIter) {
-    size_t cntrs[kBuckets] = {0};
-
-    for (size_t ind = 0; ind != size; ++ind) {
-      ++cntrs[get_bucket(vec[ind], bit)];
-    }
+  for (size_t pass = 0; pass != passes; ++pass) {
+    size_t *pass_cntrs = cntrs.data() + pass * kBuckets;
 
     bool skip_iter = false;
     size_t cumsum = 0;
     for (size_t bucket = 0; bucket != kBuckets; ++bucket) {
-      const auto bucket_cntr = cntrs[bucket];
+      const auto bucket_cntr = pass_cntrs[bucket];
       if (bucket_cntr == size) {
         skip_iter = true;
         break;
       }
-      cntrs[bucket] = cumsum;
+      pass_cntrs[bucket] = cumsum;
       cumsum += bucket_cntr;
     }
     if (skip_iter) {
       continue;
     }
 
-    for (size_t ind = 0; ind != size; ++ind) {
-      auto &cntr = cntrs[get_bucket(vec[ind], bit)];
-      extra[cntr] = std::move(vec[ind]);
-      ++cntr;
-    }
+    const size_t bit = pass * BitsPerIter;
+    Scatter<kBuckets>(vec, extra, 0, size, pass_cntrs,
+                      [&](const T &el) { return get_bucket(el, bit); });
 
-    vec.swap(extra);
+    std::swap(vec, extra);
     swapped ^= true;
   }
 
   if (swapped) {
-    vec.swap(extra);
-    std::move(extra.begin(), extra.begin() + size, vec.begin());
+    std::swap(vec, extra);
+    std::move(extra, extra + size, vec);
+  }
+}
+
+// Index of the row that goes to position `ind`, plain or next to a key
+template <class I> auto &IndexAt(I *inds, size_t ind) {
+  if constexpr (std::is_integral_v<I>) {
+    return inds[ind];
+  } else {
+    return inds[ind].ind;
+  }
+}
+
+// Applies the permutation in place cycle by cycle, leaves inds the identity
+template <class T, class I> void SortByIndices(T *data, I *inds, size_t size) {
+  T tmp;
+  T *to = &tmp;
+
+  for (size_t ind = 0; ind != size; ++ind) {
+    if (ind == IndexAt(inds, ind)) {
+      continue;
+    }
+
+    do {
+      T *from = &data[ind];
+      *to = std::move(*from);
+      to = from;
+
+      const size_t next = IndexAt(inds, ind);
+      IndexAt(inds, ind) = ind;
+      ind = next;
+    } while (ind != IndexAt(inds, ind));
+
+    *to = std::move(tmp);
+    to = &tmp;
   }
 }
 
 template <size_t BitsPerIter, class T, class KeyF,
           std::unsigned_integral KeyT = std::invoke_result_t<KeyF, const T &>>
-void MSDRadixSort(std::vector<T> &vec, std::vector<T> &extra, size_t size,
-                  KeyT min, KeyT max, KeyF key) {
+void MSDRadixSort(T *vec, T *extra, size_t size, KeyT min, KeyT max,
+                  KeyF key) {
   static_assert(BitsPerIter != 0 && BitsPerIter < sizeof(KeyT) * 8);
   constexpr size_t kBuckets = 1ull << BitsPerIter;
   constexpr size_t kMask = kBuckets - 1;
 
-  const size_t max_bit = sizeof(KeyT) * 8 - std::countl_zero(max - min);
+  const size_t max_bit = sizeof(KeyT) * 8 - std::countl_zero<KeyT>(max - min);
 
   const auto get_bucket = [key, min](const T &el, size_t bit) {
     return ((std::invoke(key, el) - min) >> bit) & kMask;
@@ -98,8 +250,8 @@ void MSDRadixSort(std::vector<T> &vec, std::vector<T> &extra, size_t size,
   size_t stack_ind = 0;
 
   for (;;) {
-    auto &sorting_vec = swapped ? extra : vec;
-    auto &sorted_vec = swapped ? vec : extra;
+    T *sorting_vec = swapped ? extra : vec;
+    T *sorted_vec = swapped ? vec : extra;
 
     size = to - from;
 
@@ -129,10 +281,8 @@ void MSDRadixSort(std::vector<T> &vec, std::vector<T> &extra, size_t size,
       }
 
       if (!skip_iter) {
-        for (size_t ind = from; ind != to; ++ind) {
-          auto &cntr = cntrs[get_bucket(sorting_vec[ind], bit)];
-          sorted_vec[cntr++] = std::move(sorting_vec[ind]);
-        }
+        Scatter<kBuckets>(sorting_vec, sorted_vec, from, to, cntrs,
+                          [&](const T &el) { return get_bucket(el, bit); });
         swapped ^= true;
       }
 
@@ -150,15 +300,30 @@ void MSDRadixSort(std::vector<T> &vec, std::vector<T> &extra, size_t size,
         ++depth;
         continue;
       }
-    } else if (size) {
-      std::sort(sorting_vec.begin() + from, sorting_vec.begin() + to,
-                [&](const T &lhs, const T &rhs) {
-                  return std::invoke(key, lhs) < std::invoke(key, rhs);
-                });
+    } else if (size > 1) {
+      // keys are taken once and sorted with their positions. Rows in `extra`
+      // then move straight to their place in `vec`, rows already in `vec`
+      // are permuted in place.
+      KeyT keys[2 * kBuckets];
+      size_t inds[2 * kBuckets];
+      for (size_t ind = 0; ind != size; ++ind) {
+        keys[ind] = std::invoke(key, sorting_vec[from + ind]);
+        inds[ind] = ind;
+      }
+      SortPairs(keys, inds, keys + kBuckets, inds + kBuckets, size);
+
+      if (swapped) {
+        for (size_t ind = 0; ind != size; ++ind) {
+          vec[from + ind] = std::move(extra[from + inds[ind]]);
+        }
+        swapped = false;
+      } else {
+        SortByIndices(vec + from, inds, size);
+      }
     }
 
     if (swapped) {
-      std::move(extra.begin() + from, extra.begin() + to, vec.begin() + from);
+      std::move(extra + from, extra + to, vec + from);
     }
 
     do {
@@ -178,62 +343,132 @@ void MSDRadixSort(std::vector<T> &vec, std::vector<T> &extra, size_t size,
   }
 }
 
-template <class T, class I>
-void SortByIndices(std::vector<T> &data, std::vector<T> &extra,
-                   std::vector<I> &inds, size_t size) {
+// Memory of `vec` as bytes
+template <class V> std::span<char> Bytes(V &vec) {
+  return {reinterpret_cast<char *>(vec.data()),
+          vec.size() * sizeof(typename V::value_type)};
+}
+
+template <class T, class A, class I>
+void SortByIndices(std::vector<T, A> &data, std::vector<T, A> &extra, I *inds,
+                   size_t size) {
   for (size_t ind = 0; ind != size; ++ind) {
-    if constexpr (std::is_same_v<I, size_t>) {
-      extra[ind] = std::move(data[inds[ind]]);
-    } else {
-      extra[ind] = std::move(data[inds[ind].ind]);
-    }
+    extra[ind] = std::move(data[IndexAt(inds, ind)]);
   }
   data.swap(extra);
 }
 
+// Moves data[inds[ind]] to out[ind] on `workers` threads, each reading the
+// rows of its slice a few indices ahead
 template <class T, class I>
-void SortByIndices(std::vector<T> &data, std::vector<I> &inds, size_t size) {
-  const auto get_ind = [&](size_t ind) -> size_t & {
-    if constexpr (std::is_same_v<I, size_t>) {
-      return inds[ind];
-    } else {
-      return inds[ind].ind;
+void GatherRows(T *data, const I *inds, T *out, size_t size, size_t workers,
+                bool pin) {
+  static constexpr size_t kPrefetch = 8;
+  static constexpr size_t kPrefetchBytes = 4 * kCacheLine;
+
+  ForEachSlice(size, workers, pin, [&](size_t, size_t from, size_t to) {
+    for (size_t ind = from; ind != to; ++ind) {
+      if (ind + kPrefetch < to) {
+        const size_t ahead = IndexAt(inds, ind + kPrefetch);
+        const auto *row = reinterpret_cast<const char *>(data + ahead);
+        for (size_t offset = 0; offset < std::min(sizeof(T), kPrefetchBytes);
+             offset += kCacheLine) {
+          __builtin_prefetch(row + offset);
+        }
+      }
+      out[ind] = std::move(data[IndexAt(inds, ind)]);
     }
-  };
-
-  T tmp;
-  T *to = &tmp;
+  });
+}
 
-  for (size_t ind = 0; ind != size; ++ind) {
-    if (ind == get_ind(ind)) {
-      continue;
-    }
+template <class KeyT> struct KeyedInd {
+  KeyT key;
+  size_t ind;
+};
 
-    do {
-      T *from = &data[ind];
-      *to = std::move(*from);
-      to = from;
+// How a block is radix sorted
+struct RadixPlan {
+  bool lsd;
+  size_t bits;
+};
 
-      std::swap(ind, get_ind(ind));
-    } while (ind != get_ind(ind));
+// LSD makes a full pass per digit however the keys are spread, MSD stops
+// once partitions are small, so LSD pays off only for narrow key ranges of
+// small rows on blocks large enough to fill its buckets
+inline RadixPlan PlanRadix(size_t size, size_t key_bits, size_t row_size) {
+  static constexpr size_t kMinLSDSize = 1 << 16;
+  static constexpr size_t kMaxLSDRow = 16;
 
-    *to = std::move(tmp);
-    to = &tmp;
+  if (size < kMinLSDSize) {
+    return {false, 8};
+  }
+  if (key_bits <= 11) {
+    // a single counting pass
+    return {true, 11};
+  }
+  if (key_bits <= 16) {
+    return {true, 8};
   }
+  if (key_bits <= 22 || (key_bits <= 33 && row_size <= kMaxLSDRow)) {
+    return {true, 11};
+  }
+  return {false, 8};
 }
 
-template <class KeyT> struct KeyedInd {
-  KeyT key;
-  size_t ind;
-};
+// The range of the keys of vec[0, size)
+template <class KeyT, class T, class KeyF>
+std::pair<KeyT, KeyT> KeyRange(const T *vec, size_t size, KeyF key) {
+  KeyT min = std::numeric_limits<KeyT>::max();
+  KeyT max = std::numeric_limits<KeyT>::min();
+  for (size_t ind = 0; ind != size; ++ind) {
+    const KeyT value = std::invoke(key, vec[ind]);
+    min = std::min(min, value);
+    max = std::max(max, value);
+  }
+  return {min, max};
+}
 
 } // namespace details
 
+// Radix sort planned per call from the block size, the bit width of the key
+// range and the row size, every variant is instantiated up front. A block
+// whose range is not given has it measured first if it is large.
 struct {
+  template <class T, class A, class KeyF, class KeyT>
+  void operator()(std::vector<T, A> &vec, std::vector<T, A> &extra,
+                  size_t size, KeyT min, KeyT max, KeyF key) const {
+    (*this)(vec.data(), extra.data(), size, min, max, key);
+  }
+
   template <class T, class KeyF, class KeyT>
-  void operator()(std::vector<T> &vec, std::vector<T> &extra, size_t size,
-                  KeyT min, KeyT max, KeyF key) const {
-    details::MSDRadixSort<8>(vec, extra, size, min, max, key);
+  void operator()(T *vec, T *extra, size_t size, KeyT min, KeyT max,
+                  KeyF key) const {
+    static constexpr size_t kMinRangeScan = 1 << 16;
+
+    if (size >= kMinRangeScan && min == std::numeric_limits<KeyT>::min() &&
+        max == std::numeric_limits<KeyT>::max()) {
+      std::tie(min, max) = details::KeyRange<KeyT>(vec, size, key);
+    }
+
+    if (min == max) {
+      return;
+    }
+
+    const size_t key_bits =
+        sizeof(KeyT) * 8 - std::countl_zero<KeyT>(max - min);
+    const auto plan = details::PlanRadix(size, key_bits, sizeof(T));
+
+    if (plan.lsd) {
+      if constexpr (sizeof(KeyT) * 8 > 11) {
+        if (plan.bits == 11) {
+          details::LSDRadixSort<11>(vec, extra, size, min, max, key);
+          return;
+        }
+      }
+      details::LSDRadixSort<8>(vec, extra, size, min, max, key);
+    } else {
+      details::MSDRadixSort<8>(vec, extra, size, min, max, key);
+    }
   }
 } constexpr RadixSort;
 
@@ -244,20 +479,75 @@ public:
 
   virtual ~SortBuffer() = default;
 
-  SortBuffer(size_t size, KeyF key) : key(key), data_(size) {}
+  SortBuffer(size_t size, KeyF key, const MemoryOptions &memory = {})
+      : key(key), data_(size, SortAllocator<T>(memory)),
+        workers_(memory.Workers()), pin_(memory.Pinned()) {}
 
   T &operator[](size_t ind) { return data_[ind]; }
   const T &operator[](size_t ind) const { return data_[ind]; }
 
   size_t Size() const { return data_.size(); }
 
+  // Fills the buffer from `input`, returns the number of rows read. Bytes of
+  // string_view fields are copied into the arena of the block, which the next
+  // Read reuses.
+  template <class I> size_t Read(I &input, size_t count) {
+    arena_.Reset();
+
+    if constexpr (requires { input.Read(data_.data(), count); }) {
+      const size_t read = input.Read(data_.data(), count);
+      Store(0, read);
+      return read;
+    } else {
+      size_t ind = 0;
+      for (; ind != count && !input.Eof(); ++ind) {
+        input >> data_[ind];
+        Store(ind, 1);
+      }
+      return ind;
+    }
+  }
+
+  template <class O> void Write(O &output, size_t count) const {
+    if constexpr (requires { output.Write(data_.data(), count); }) {
+      output.Write(data_.data(), count);
+    } else {
+      for (size_t ind = 0; ind != count; ++ind) {
+        output << data_[ind];
+      }
+    }
+  }
+
   virtual void Clear() {
     data_.clear();
     data_.shrink_to_fit();
+    scratch_.clear();
+    scratch_.shrink_to_fit();
+    arena_.Release();
+  }
+
+  // Bytes of the rows, lent out as spill buffers once the rows are written
+  // (see io::BufferPool), the next Read overwrites whatever they hold
+  std::span<char> Storage()
+    requires std::is_trivially_copyable_v<T>
+  {
+    return details::Bytes(data_);
+  }
+
+  // Whether the first `size` rows are already in key order
+  bool Sorted(size_t size) const {
+    return std::is_sorted(data_.begin(), data_.begin() + size,
+                          [&](const T &lhs, const T &rhs) {
+                            return std::invoke(key, lhs) <
+                                   std::invoke(key, rhs);
+                          });
   }
 
   virtual void Sort(size_t size, KeyT = std::numeric_limits<KeyT>::min(),
                     KeyT = std::numeric_limits<KeyT>::max()) {
+    if (SortPresorted(size)) {
+      return;
+    }
     std::sort(data_.begin(), data_.begin() + size,
               [&](const T &lhs, const T &rhs) {
                 return std::invoke(key, lhs) < std::invoke(key, rhs);
@@ -267,8 +557,76 @@ public:
 public:
   KeyF key;
 
+private:
+  void Store(size_t from, size_t count) {
+    if constexpr (io::ArenaBacked<T>) {
+      for (size_t ind = from; ind != from + count; ++ind) {
+        data_[ind].Store(arena_);
+      }
+    }
+  }
+
+protected:
+  void ReserveScratch(const MemoryOptions &memory) {
+    if (memory.scratch_rows) {
+      scratch_ = SortVector<T>(data_.size(), SortAllocator<T>(memory));
+    }
+  }
+
+  // `spare` (free index memory) as rows, empty unless the rows are plain
+  // bytes and the memory is aligned for them
+  static std::span<T> SpareRows(std::span<char> spare) {
+    if constexpr (std::is_trivially_copyable_v<T>) {
+      if (reinterpret_cast<uintptr_t>(spare.data()) % alignof(T) == 0) {
+        return {reinterpret_cast<T *>(spare.data()), spare.size() / sizeof(T)};
+      }
+    }
+    return {};
+  }
+
+  // Sorts ascending, descending and few-run blocks without a full sort,
+  // merging through `extra` or the scratch rows. False if the block has to
+  // be sorted for real.
+  bool SortPresorted(size_t size, std::span<T> extra = {}) {
+    if (extra.size() < scratch_.size()) {
+      extra = scratch_;
+    }
+    return details::SortPresorted(data_.data(), size, extra, key);
+  }
+
+  // Puts row inds[ind] at ind for the first `size` rows. Rows are gathered
+  // on all workers into the scratch rows if the buffer keeps them, or into
+  // `spare` (free index memory) if they fit there and are plain bytes,
+  // otherwise they are moved along the cycles of the permutation in place.
+  template <class I>
+  void Permute(I *inds, size_t size, std::span<char> spare = {}) {
+    if (scratch_.size() >= size) {
+      details::GatherRows(data_.data(), inds, scratch_.data(), size, workers_,
+                          pin_);
+      data_.swap(scratch_);
+      return;
+    }
+
+    if (const std::span<T> rows = SpareRows(spare); rows.size() >= size) {
+      details::GatherRows(data_.data(), inds, rows.data(), size, workers_,
+                          pin_);
+      details::ForEachSlice(size, workers_, pin_,
+                            [&](size_t, size_t from, size_t to) {
+                              std::copy(rows.data() + from, rows.data() + to,
+                                        data_.data() + from);
+                            });
+      return;
+    }
+
+    details::SortByIndices(data_.data(), inds, size);
+  }
+
 protected:
-  std::vector<T> data_;
+  SortVector<T> data_;
+  SortVector<T> scratch_;
+  size_t workers_;
+  bool pin_;
+  io::Arena arena_;
 };
 
 template <class T, class KeyF>
@@ -276,8 +634,9 @@ class RadixSortBuffer : public SortBuffer<T, KeyF> {
 public:
   using typename SortBuffer<T, KeyF>::KeyT;
 
-  RadixSortBuffer(size_t size, KeyF key)
-      : SortBuffer<T, KeyF>(size, key), extra_(size) {}
+  RadixSortBuffer(size_t size, KeyF key, const MemoryOptions &memory = {})
+      : SortBuffer<T, KeyF>(size, key, memory),
+        extra_(size, SortAllocator<T>(memory)) {}
 
   void Clear() override {
     SortBuffer<T, KeyF>::Clear();
@@ -287,6 +646,9 @@ public:
 
   void Sort(size_t size, KeyT min = std::numeric_limits<KeyT>::min(),
             KeyT max = std::numeric_limits<KeyT>::max()) override {
+    if (this->SortPresorted(size, extra_)) {
+      return;
+    }
     RadixSort(data_, extra_, size, min, max, key);
   }
 
@@ -295,7 +657,7 @@ public:
 
 private:
   using SortBuffer<T, KeyF>::data_;
-  std::vector<T> extra_;
+  SortVector<T> extra_;
 };
 
 template <class T, class KeyF>
@@ -303,9 +665,10 @@ class IndicesSortBuffer : public SortBuffer<T, KeyF> {
 public:
   using typename SortBuffer<T, KeyF>::KeyT;
 
-  IndicesSortBuffer(size_t size, KeyF key)
-      : SortBuffer<T, KeyF>(size, key), inds_(size) {
-    std::iota(inds_.begin(), inds_.end(), 0);
+  IndicesSortBuffer(size_t size, KeyF key, const MemoryOptions &memory = {})
+      : SortBuffer<T, KeyF>(size, key, memory),
+        inds_(size, SortAllocator<size_t>(memory)) {
+    this->ReserveScratch(memory);
   }
 
   void Clear() override {
@@ -314,20 +677,53 @@ public:
     inds_.shrink_to_fit();
   }
 
+  // If the scratch rows hold a key column and the pair scratch, keys are
+  // read once and sorted next to the indices, otherwise the indices are
+  // sorted by keys read from the rows
   void Sort(size_t size, KeyT = std::numeric_limits<KeyT>::min(),
             KeyT = std::numeric_limits<KeyT>::max()) override {
-    std::sort(inds_.begin(), inds_.begin() + size, [&](size_t lhs, size_t rhs) {
-      return std::invoke(key, data_[lhs]) < std::invoke(key, data_[rhs]);
-    });
-    details::SortByIndices(data_, inds_, size);
+    if (this->SortPresorted(size)) {
+      return;
+    }
+    std::iota(inds_.begin(), inds_.begin() + size, 0);
+    if (!SortPairs(size)) {
+      std::sort(inds_.begin(), inds_.begin() + size,
+                [&](size_t lhs, size_t rhs) {
+                  return std::invoke(key, data_[lhs]) <
+                         std::invoke(key, data_[rhs]);
+                });
+    }
+    this->Permute(inds_.data(), size);
   }
 
 public:
   using SortBuffer<T, KeyF>::key;
 
+private:
+  // Scratch indices, keys and scratch keys, in this order, in the scratch
+  // rows, which are free until Permute gathers into them
+  bool SortPairs(size_t size) {
+    if constexpr (std::is_trivially_copyable_v<T>) {
+      const auto scratch = details::Bytes(this->scratch_);
+      if (reinterpret_cast<uintptr_t>(scratch.data()) % alignof(size_t) != 0 ||
+          scratch.size() / size < sizeof(size_t) + 2 * sizeof(KeyT)) {
+        return false;
+      }
+
+      auto *extra_inds = reinterpret_cast<size_t *>(scratch.data());
+      auto *keys = reinterpret_cast<KeyT *>(extra_inds + size);
+      for (size_t ind = 0; ind != size; ++ind) {
+        keys[ind] = std::invoke(key, data_[ind]);
+      }
+      details::SortPairs(keys, inds_.data(), keys + size, extra_inds, size);
+      return true;
+    }
+    return false;
+  }
+
 protected:
   using SortBuffer<T, KeyF>::data_;
-  std::vector<size_t> inds_;
+  SortVector<size_t> inds_;
 };
 
 template <class T, class KeyF>
@@ -335,9 +731,12 @@ class RadixIndicesSortBuffer : public SortBuffer<T, KeyF> {
 public:
   using typename SortBuffer<T, KeyF>::KeyT;
 
-  RadixIndicesSortBuffer(size_t size, KeyF key)
-      : SortBuffer<T, KeyF>(size, key), inds_(size), extra_(size) {
-    std::iota(inds_.begin(), inds_.end(), 0);
+  RadixIndicesSortBuffer(size_t size, KeyF key,
+                         const MemoryOptions &memory = {})
+      : SortBuffer<T, KeyF>(size, key, memory),
+        inds_(size, SortAllocator<size_t>(memory)),
+        extra_(size, SortAllocator<size_t>(memory)) {
+    this->ReserveScratch(memory);
   }
 
   void Clear() override {
@@ -348,20 +747,37 @@ public:
     extra_.shrink_to_fit();
   }
 
+  // Blocks of fewer than 2^32 rows sort 32-bit indices in the same memory,
+  // every radix pass moves half the bytes
   void Sort(size_t size, KeyT min = std::numeric_limits<KeyT>::min(),
             KeyT max = std::numeric_limits<KeyT>::max()) override {
-    RadixSort(inds_, extra_, size, min, max,
-              [&](size_t ind) { return std::invoke(key, data_[ind]); });
-    details::SortByIndices(data_, inds_, size);
+    if (this->SortPresorted(size, this->SpareRows(details::Bytes(extra_)))) {
+      return;
+    }
+    if (size <= std::numeric_limits<uint32_t>::max()) {
+      Sort(reinterpret_cast<uint32_t *>(inds_.data()),
+           reinterpret_cast<uint32_t *>(extra_.data()), size, min, max);
+    } else {
+      Sort(inds_.data(), extra_.data(), size, min, max);
+    }
   }
 
 public:
   using SortBuffer<T, KeyF>::key;
 
+private:
+  template <class I>
+  void Sort(I *inds, I *extra, size_t size, KeyT min, KeyT max) {
+    std::iota(inds, inds + size, I{0});
+    RadixSort(inds, extra, size, min, max,
+              [&](I ind) { return std::invoke(key, data_[ind]); });
+    this->Permute(inds, size, details::Bytes(extra_));
+  }
+
 protected:
   using SortBuffer<T, KeyF>::data_;
-  std::vector<size_t> inds_;
-  std::vector<size_t> extra_;
+  SortVector<size_t> inds_;
+  SortVector<size_t> extra_;
 };
 
 template <class T, class KeyF>
@@ -369,8 +785,13 @@ class RadixKeyedIndicesSortBuffer : public SortBuffer<T, KeyF> {
 public:
   using typename SortBuffer<T, KeyF>::KeyT;
 
-  RadixKeyedIndicesSortBuffer(size_t size, KeyF key)
-      : SortBuffer<T, KeyF>(size, key), keyed_inds_(size), extra_(size) {}
+  RadixKeyedIndicesSortBuffer(size_t size, KeyF key,
+                              const MemoryOptions &memory = {})
+      : SortBuffer<T, KeyF>(size, key, memory),
+        keyed_inds_(size, SortAllocator<details::KeyedInd<KeyT>>(memory)),
+        extra_(size, SortAllocator<details::KeyedInd<KeyT>>(memory)) {
+    this->ReserveScratch(memory);
+  }
 
   void Clear() override {
     SortBuffer<T, KeyF>::Clear();
@@ -380,8 +801,25 @@ public:
     extra_.shrink_to_fit();
   }
 
+  // Blocks of fewer than 2^32 rows whose keys span at most 32 bits sort
+  // 8 byte words, the rebased key above the row index, in the memory of the
+  // 16 byte pairs
   void Sort(size_t size, KeyT min = std::numeric_limits<KeyT>::min(),
             KeyT max = std::numeric_limits<KeyT>::max()) override {
+    if (this->SortPresorted(size, this->SpareRows(details::Bytes(extra_)))) {
+      return;
+    }
+    if (min == std::numeric_limits<KeyT>::min() &&
+        max == std::numeric_limits<KeyT>::max()) {
+      std::tie(min, max) = details::KeyRange<KeyT>(data_.data(), size, key);
+    }
+
+    if (size <= std::numeric_limits<uint32_t>::max() &&
+        static_cast<KeyT>(max - min) <= std::numeric_limits<uint32_t>::max()) {
+      SortPacked(size, min, max);
+      return;
+    }
+
     for (size_t ind = 0; ind != size; ++ind) {
       keyed_inds_[ind].key = std::invoke(key, data_[ind]);
       keyed_inds_[ind].ind = ind;
@@ -390,16 +828,41 @@ public:
               [&](const details::KeyedInd<KeyT> &keyed_ind) {
                 return keyed_ind.key;
               });
-    details::SortByIndices(data_, keyed_inds_, size);
+    this->Permute(keyed_inds_.data(), size, details::Bytes(extra_));
   }
 
 public:
   using SortBuffer<T, KeyF>::key;
 
 private:
+  void SortPacked(size_t size, KeyT min, KeyT max) {
+    auto *words = reinterpret_cast<uint64_t *>(keyed_inds_.data());
+    auto *extra = reinterpret_cast<uint64_t *>(extra_.data());
+
+    for (size_t ind = 0; ind != size; ++ind) {
+      const uint64_t rebased =
+          static_cast<KeyT>(std::invoke(key, data_[ind]) - min);
+      words[ind] = rebased << 32 | ind;
+    }
+    RadixSort(words, extra, size, uint64_t{0},
+              uint64_t{static_cast<KeyT>(max - min)},
+              [](uint64_t word) { return word >> 32; });
+
+    // indices are compacted in place, each lands below the word it came from
+    auto *bytes = reinterpret_cast<char *>(words);
+    for (size_t ind = 0; ind != size; ++ind) {
+      uint64_t word;
+      std::memcpy(&word, bytes + ind * sizeof(word), sizeof(word));
+      const auto row = static_cast<uint32_t>(word);
+      std::memcpy(bytes + ind * sizeof(row), &row, sizeof(row));
+    }
+    this->Permute(reinterpret_cast<uint32_t *>(words), size,
+                  details::Bytes(extra_));
+  }
+
   using SortBuffer<T, KeyF>::data_;
-  std::vector<details::KeyedInd<KeyT>> keyed_inds_;
-  std::vector<details::KeyedInd<KeyT>> extra_;
+  SortVector<details::KeyedInd<KeyT>> keyed_inds_;
+  SortVector<details::KeyedInd<KeyT>> extra_;
 };
 
 } // namespace sorting
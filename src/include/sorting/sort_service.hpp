@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <arrow/api.h>
+
+#include <sorting/settings.hpp>
+#include <sorting/spill_space.hpp>
+
+namespace sorting {
+
+// Resources granted to one job of a SortService
+struct SortJob {
+  size_t id;
+  // bytes of RAM the job sizes its sort buffer by
+  size_t memory;
+  // spill directories of the job alone, one per service directory
+  std::vector<std::string> spill_dirs;
+
+  // `options` spilling into the directories of the job
+  SortOptions Options(SortOptions options = {}) const {
+    options.spill_dirs = spill_dirs;
+    return options;
+  }
+};
+
+// Runs sort jobs on a fixed set of worker threads within a shared memory and
+// spill space budget. Jobs start in submission order as soon as their share
+// of both budgets is free, so concurrent jobs never overcommit the host, and
+// each job spills into its own job-<pid>-<n> subdirectory of every spill
+// directory, so jobs never see each other's runs, even when several services
+// or processes share the spill directories.
+class SortService {
+  struct Pending {
+    size_t memory;
+    size_t spill;
+    std::function<void(const SortJob &)> run;
+  };
+
+public:
+  SortService(size_t memory, size_t spill, size_t workers,
+              std::vector<std::string> spill_dirs = {kTmpSortDir})
+      : memory_(memory), spill_(spill), spill_dirs_(std::move(spill_dirs)) {
+    // the spill directories outlive the jobs, a missing one is removed with
+    // the service once the last job in the process leaves it
+    for (const auto &dir : spill_dirs_) {
+      details::SpillRoots::Join(dir);
+    }
+    for (size_t ind = 0; ind != std::max<size_t>(workers, 1); ++ind) {
+      workers_.emplace_back([this] { Run(); });
+    }
+  }
+
+  SortService(const SortService &) = delete;
+
+  // Waits for every submitted job
+  ~SortService() {
+    {
+      std::lock_guard lock(mutex_);
+      stop_ = true;
+    }
+    changed_.notify_all();
+
+    for (auto &worker : workers_) {
+      worker.join();
+    }
+    for (const auto &dir : spill_dirs_) {
+      details::SpillRoots::Leave(dir);
+    }
+  }
+
+  // Queues `job`, a callable taking const SortJob &, that needs `memory`
+  // bytes of RAM and up to `spill` bytes of spill space. Memory requests are
+  // capped at the whole budget, a job that cannot fit into the spill budget
+  // fails right away.
+  template <class F> auto Submit(size_t memory, size_t spill, F job) {
+    using R = std::invoke_result_t<F, const SortJob &>;
+
+    auto task = std::make_shared<std::packaged_task<R(const SortJob &)>>(
+        std::move(job));
+    auto result = task->get_future();
+
+    if (spill > spill_) {
+      if constexpr (std::is_constructible_v<R, arrow::Status>) {
+        std::promise<R> rejected;
+        rejected.set_value(arrow::Status::CapacityError(
+            "Job needs ", spill, " bytes of spill space, budget is ", spill_));
+        return rejected.get_future();
+      } else {
+        throw std::length_error("Job does not fit the spill budget");
+      }
+    }
+
+    {
+      std::lock_guard lock(mutex_);
+      queue_.push_back({std::min(memory, memory_), spill,
+                        [task](const SortJob &granted) { (*task)(granted); }});
+    }
+    changed_.notify_all();
+
+    return result;
+  }
+
+private:
+  bool Fits(const Pending &job) const {
+    return used_memory_ + job.memory <= memory_ &&
+           used_spill_ + job.spill <= spill_;
+  }
+
+  void Run() {
+    for (;;) {
+      std::unique_lock lock(mutex_);
+      changed_.wait(lock, [&] {
+        return (!queue_.empty() && Fits(queue_.front())) ||
+               (stop_ && queue_.empty());
+      });
+      if (queue_.empty()) {
+        return;
+      }
+
+      Pending job = std::move(queue_.front());
+      queue_.pop_front();
+      used_memory_ += job.memory;
+      used_spill_ += job.spill;
+
+      SortJob granted{next_id_++, job.memory, {}};
+      const std::string name = details::UniqueSpillName("job");
+      for (const auto &dir : spill_dirs_) {
+        granted.spill_dirs.push_back(
+            (std::filesystem::path(dir) / name).string());
+      }
+      lock.unlock();
+
+      // a job that was admitted may let the next one in too
+      changed_.notify_all();
+      job.run(granted);
+      // runs of failed jobs are left behind by the sort itself
+      for (const auto &dir : granted.spill_dirs) {
+        std::error_code error;
+        std::filesystem::remove_all(dir, error);
+      }
+
+      lock.lock();
+      used_memory_ -= job.memory;
+      used_spill_ -= job.spill;
+      lock.unlock();
+      changed_.notify_all();
+    }
+  }
+
+private:
+  const size_t memory_;
+  const size_t spill_;
+  const std::vector<std::string> spill_dirs_;
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<Pending> queue_;
+  size_t used_memory_ = 0;
+  size_t used_spill_ = 0;
+  size_t next_id_ = 0;
+  bool stop_ = false;
+
+  std::vector<std::thread> workers_;
+};
+
+} // namespace sorting
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <sorting/settings.hpp>
+
+namespace sorting {
+
+namespace details {
+
+// <prefix>-<pid>-<n>, unique among the jobs of all processes sharing a spill
+// directory
+inline std::string UniqueSpillName(const std::string &prefix) {
+  static std::atomic<size_t> next = 0;
+  return prefix + "-" + std::to_string(getpid()) + "-" +
+         std::to_string(next++);
+}
+
+// Spill directories in use by the jobs of this process. A directory that a
+// job had to create is removed once the last job leaves it, whichever job
+// that is, if no other process left files in it.
+class SpillRoots {
+public:
+  // Creates `root` if it is missing
+  static void Join(const std::string &root) {
+    std::lock_guard lock(Mutex());
+    const bool created = std::filesystem::create_directories(root);
+    auto &entry = Entries()[Key(root)];
+    entry.created |= created;
+    ++entry.jobs;
+  }
+
+  static void Leave(const std::string &root) {
+    std::lock_guard lock(Mutex());
+    const auto it = Entries().find(Key(root));
+    if (it == Entries().end() || --it->second.jobs) {
+      return;
+    }
+
+    if (it->second.created) {
+      std::error_code error;
+      std::filesystem::remove(root, error);
+    }
+    Entries().erase(it);
+  }
+
+private:
+  struct Entry {
+    size_t jobs = 0;
+    bool created = false;
+  };
+
+  static std::string Key(const std::string &root) {
+    auto path = std::filesystem::absolute(root).lexically_normal();
+    if (!path.has_filename()) {
+      path = path.parent_path();
+    }
+    return path.string();
+  }
+
+  static std::mutex &Mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static std::map<std::string, Entry> &Entries() {
+    static std::map<std::string, Entry> entries;
+    return entries;
+  }
+};
+
+} // namespace details
+
+// Spill files of a sort job striped over spill directories, one per device,
+// so runs and buckets written one after another land on different devices
+// and a merge reads all of them at once. The job spills into a subdirectory
+// of its own in every spill directory, so jobs sharing a spill directory, in
+// one process or several, never touch each other's files.
+class SpillSpace {
+  static constexpr size_t kUnassigned = std::numeric_limits<size_t>::max();
+
+public:
+  explicit SpillSpace(std::vector<std::string> dirs = {kTmpSortDir},
+                      Striping striping = Striping::kRoundRobin)
+      : roots_(std::move(dirs)), striping_(striping) {
+    if (roots_.empty()) {
+      roots_.push_back(kTmpSortDir);
+    }
+
+    const std::string name = details::UniqueSpillName("sort");
+    for (const auto &root : roots_) {
+      dirs_.push_back((std::filesystem::path(root) / name).string());
+    }
+    files_.resize(dirs_.size());
+  }
+
+  explicit SpillSpace(const SortOptions &options)
+      : SpillSpace(options.spill_dirs, options.striping) {}
+
+  SpillSpace(const SpillSpace &) = delete;
+
+  // Jobs that fail half way leave no spill files behind
+  ~SpillSpace() { Remove(); }
+
+  // Must be called before the first Path
+  void Create() {
+    available_.clear();
+    for (size_t ind = 0; ind != dirs_.size(); ++ind) {
+      if (ind == joined_) {
+        details::SpillRoots::Join(roots_[ind]);
+        ++joined_;
+      }
+      std::filesystem::create_directories(dirs_[ind]);
+
+      std::error_code error;
+      const auto space = std::filesystem::space(dirs_[ind], error);
+      available_.push_back(error ? 0 : space.available);
+    }
+  }
+
+  // Removes the directories of the job, and the spill directories a job
+  // created once no other job uses them (see details::SpillRoots)
+  void Remove() {
+    std::error_code error;
+    issued_.clear();
+
+    for (size_t ind = 0; ind != joined_; ++ind) {
+      std::filesystem::remove_all(dirs_[ind], error);
+      details::SpillRoots::Leave(roots_[ind]);
+    }
+    joined_ = 0;
+  }
+
+  // Path of spill file `id`, the directory is picked on the first call
+  std::string Path(size_t id) {
+    return Issue(std::filesystem::path(dirs_[Dir(id)]) / std::to_string(id));
+  }
+
+  // Path of a named spill file, kept in the first directory
+  std::string Path(const std::string &name) {
+    return Issue(std::filesystem::path(dirs_.front()) / name);
+  }
+
+private:
+  std::string Issue(const std::filesystem::path &path) {
+    return *issued_.insert(path.string()).first;
+  }
+
+  size_t Dir(size_t id) {
+    if (striping_ == Striping::kRoundRobin) {
+      return id % dirs_.size();
+    }
+
+    if (assigned_.size() <= id) {
+      assigned_.resize(id + 1, kUnassigned);
+    }
+    if (assigned_[id] == kUnassigned) {
+      assigned_[id] = NextByFreeSpace();
+    }
+    return assigned_[id];
+  }
+
+  // Directory that is furthest below its share of files, shares follow the
+  // free space the directories had when the job started
+  size_t NextByFreeSpace() {
+    size_t best = 0;
+    for (size_t ind = 1; ind != dirs_.size(); ++ind) {
+      // files[ind] / available[ind] < files[best] / available[best]
+      if ((files_[ind] + 1) * static_cast<double>(available_[best]) <
+          (files_[best] + 1) * static_cast<double>(available_[ind])) {
+        best = ind;
+      }
+    }
+
+    ++files_[best];
+    return best;
+  }
+
+private:
+  std::vector<std::string> roots_;
+  // subdirectories of the job
+  std::vector<std::string> dirs_;
+  Striping striping_;
+  std::vector<size_t> assigned_;
+  std::vector<std::uintmax_t> available_;
+  std::vector<size_t> files_;
+  // spill directories joined by Create, a prefix of roots_
+  size_t joined_ = 0;
+  std::set<std::string> issued_;
+};
+
+} // namespace sorting
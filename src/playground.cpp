@@ -19,8 +19,9 @@ int main() {
     const auto res = utils::ResultedTimeExecution(
         &sorting::MergeSort<Row, io::BatchIStream<Row>,
                             models::BinaryStreams<Row>, io::BatchOStream<Row>,
-                            decltype(buffer.key)>,
-        "static/row_16gib.parquet", "sorted", 64, buffer);
+                            decltype(buffer)>,
+        "static/row_16gib.parquet", "sorted", 64, buffer,
+        sorting::SortOptions{});
 
     std::cout << res.ms.count() << ", " << res->fp_read.count() << ", "
               << res->fp_sort.count() << ", " << res->fp_write.count()
@@ -32,7 +33,8 @@ int main() {
         &sorting::BucketSort<Row, io::BatchIStream<Row>,
                              models::BinaryStreams<Row>, io::BatchOStream<Row>,
                              decltype(buffer.key)>,
-        "static/row_16gib.parquet", "sorted", 64, buffer, 0, -1ul);
+        "static/row_16gib.parquet", "sorted", 64, buffer, 0, -1ul,
+        sorting::SortOptions{});
 
     std::cout << res->count() << " ms\n";
   }
@@ -1,9 +1,13 @@
 #include <gtest/gtest.h>
 
+#include <io/parquet_stitch.hpp>
 #include <models/io_stream.hpp>
 #include <sorting/arrow_sort.hpp>
 #include <sorting/bucket_sort.hpp>
+#include <sorting/columnar_sort_buffer.hpp>
+#include <sorting/late_materialization.hpp>
 #include <sorting/merge_sort.hpp>
+#include <sorting/sort_service.hpp>
 
 #include "data.hpp"
 #include "system_check/disk_binary.hpp"
@@ -71,6 +75,343 @@ TEST_F(DataTest, MergeSort) {
     ASSERT_EQ(result.status(), arrow::Status::OK());
     AssertOrder();
   }
+  {
+    sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+        500_MiB / sizeof(Row), RowKey);
+    const auto result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>, models::IpcStreams<Row>,
+                           io::BatchOStream<Row>>(kDataFile, kTmpOutputFile,
+                                                  256, buffer);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    AssertOrder();
+  }
+  {
+    sorting::ColumnarSortBuffer<Row, decltype(&RowKey)> buffer(
+        500_MiB / sizeof(Row), RowKey);
+    const auto result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>,
+                           models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+            kDataFile, kTmpOutputFile, 256, buffer);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    AssertOrder();
+  }
+  {
+    sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+        500_MiB / sizeof(Row), RowKey);
+    const auto result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>,
+                           models::KeyedBinaryStreams<Row, decltype(&RowKey)>,
+                           io::BatchOStream<Row>>(kDataFile, kTmpOutputFile,
+                                                  256, buffer);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    AssertOrder();
+  }
+  {
+    sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+        500_MiB / sizeof(Row), RowKey);
+    sorting::SortOptions options;
+    options.spill.codec = arrow::Compression::LZ4_FRAME;
+
+    const auto result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>,
+                           models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+            kDataFile, kTmpOutputFile, 256, buffer, options);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    AssertOrder();
+  }
+  {
+    sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+        500_MiB / sizeof(Row), RowKey);
+    sorting::SortOptions options;
+    options.spill_dirs = {".tmp_spill_0/", ".tmp_spill_1/"};
+    options.spill.read_ahead = true;
+
+    const auto result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>,
+                           models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+            kDataFile, kTmpOutputFile, 256, buffer, options);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    ASSERT_FALSE(std::filesystem::exists(options.spill_dirs[0]));
+    AssertOrder();
+  }
+  {
+    io::BufferPool pool(256_MiB, true);
+    sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+        500_MiB / sizeof(Row), RowKey);
+    sorting::SortOptions options;
+    options.pool = &pool;
+
+    const auto result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>,
+                           models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+            kDataFile, kTmpOutputFile, 256, buffer, options);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    ASSERT_EQ(pool.Used(), 0u);
+    ASSERT_EQ(pool.bytes_allocated(), 0);
+    ASSERT_GT(pool.num_allocations(), 0);
+    AssertOrder();
+  }
+  {
+    sorting::RadixKeyedIndicesSortBuffer<Row, decltype(&RowKey)> buffer(
+        500_MiB / sizeof(Row), RowKey,
+        {sorting::PageSize::kHuge, sorting::Placement::kLocal});
+    const auto result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>,
+                           models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+            kDataFile, kTmpOutputFile, 256, buffer);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    AssertOrder();
+  }
+  {
+    sorting::MemoryOptions memory;
+    memory.workers = 4;
+    memory.scratch_rows = true;
+    sorting::IndicesSortBuffer<Row, decltype(&RowKey)> buffer(
+        250_MiB / sizeof(Row), RowKey, memory);
+    const auto result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>,
+                           models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+            kDataFile, kTmpOutputFile, 256, buffer);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    AssertOrder();
+  }
+  {
+    // sorted input passes straight through, unsorted falls back to sorting
+    const std::string sorted_file = ".tmp_sorted_input";
+    sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+        500_MiB / sizeof(Row), RowKey);
+    sorting::SortOptions options;
+    options.key_column = "field";
+
+    auto result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>,
+                           models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+            kDataFile, sorted_file, 256, buffer, options);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+
+    result =
+        sorting::MergeSort<Row, io::BatchIStream<Row>,
+                           models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+            sorted_file, kTmpOutputFile, 256, buffer, options);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    ASSERT_EQ(result->fp_sort.count(), 0);
+    AssertOrder();
+    std::filesystem::remove(sorted_file);
+  }
+}
+
+TEST_F(DataTest, DatasetMergeSort) {
+  const std::string dataset_dir = ".tmp_dataset/";
+  std::filesystem::create_directories(dataset_dir);
+  std::filesystem::copy_file(kDataFile, dataset_dir + "part-0.parquet");
+  std::filesystem::copy_file(kDataFile, dataset_dir + "part-1.parquet");
+
+  sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+      500_MiB / sizeof(Row), RowKey);
+  const auto result =
+      sorting::MergeSort<Row, io::DatasetIStream<Row>,
+                         models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+          dataset_dir, kTmpOutputFile, 256, buffer);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  AssertOrder();
+
+  std::filesystem::remove_all(dataset_dir);
+}
+
+TEST_F(DataTest, PresortedMergeSort) {
+  // two sorted copies of the data make a block of two runs, which is merged
+  // instead of sorted
+  const std::string dataset_dir = ".tmp_presorted/";
+  std::filesystem::create_directories(dataset_dir);
+
+  sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+      500_MiB / sizeof(Row), RowKey);
+  auto result =
+      sorting::MergeSort<Row, io::BatchIStream<Row>,
+                         models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+          kDataFile, dataset_dir + "part-0.parquet", 256, buffer);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  std::filesystem::copy_file(dataset_dir + "part-0.parquet",
+                             dataset_dir + "part-1.parquet");
+
+  result =
+      sorting::MergeSort<Row, io::DatasetIStream<Row>,
+                         models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+          dataset_dir, kTmpOutputFile, 256, buffer);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  AssertOrder();
+
+  std::filesystem::remove_all(dataset_dir);
+}
+
+TEST(BatchIStream, ProjectionAndPredicate) {
+  // row groups of 1024 rows, the third one holds signed values -2..1021
+  static constexpr int64_t kRows = 4096;
+  static constexpr int64_t kZero = 2050;
+  arrow::Int64Builder signed_builder;
+  arrow::UInt64Builder pad_builder, field_builder;
+  for (int64_t ind = 0; ind != kRows; ++ind) {
+    PARQUET_THROW_NOT_OK(signed_builder.Append(ind - kZero));
+    PARQUET_THROW_NOT_OK(pad_builder.Append(0));
+    PARQUET_THROW_NOT_OK(field_builder.Append(ind));
+  }
+  const auto schema = arrow::schema({arrow::field("signed", arrow::int64()),
+                                     arrow::field("pad", arrow::uint64()),
+                                     arrow::field("field", arrow::uint64())});
+  const auto table = arrow::Table::Make(
+      schema, {*signed_builder.Finish(), *pad_builder.Finish(),
+               *field_builder.Finish()});
+  std::shared_ptr<arrow::io::FileOutputStream> outfile;
+  PARQUET_ASSIGN_OR_THROW(outfile,
+                          arrow::io::FileOutputStream::Open(kDataFile));
+  PARQUET_THROW_NOT_OK(parquet::arrow::WriteTable(
+      *table, arrow::default_memory_pool(), outfile, 1024));
+  PARQUET_THROW_NOT_OK(outfile->Close());
+
+  ASSERT_TRUE(io::SortedByStatistics(kDataFile, "field"));
+  ASSERT_FALSE(io::SortedByStatistics(kDataFile, "signed"));
+
+  // fields of the rows read for `predicate`, the columns of Row only
+  const auto read = [](std::optional<io::RangePredicate> predicate) {
+    io::ParquetSettings settings(1_MiB, 256, kDataFile);
+    io::BatchIStream<Row> input(kDataFile, settings, predicate);
+    std::vector<uint64_t> fields;
+    Row row;
+    while (!input.Eof()) {
+      input >> row;
+      fields.push_back(row.field);
+    }
+    return fields;
+  };
+  const auto fields_range = [](uint64_t from, uint64_t to) {
+    std::vector<uint64_t> fields(to - from);
+    std::iota(fields.begin(), fields.end(), from);
+    return fields;
+  };
+
+  ASSERT_EQ(read(std::nullopt), fields_range(0, kRows));
+  // the first two row groups are skipped, the third is filtered
+  ASSERT_EQ(read(io::RangePredicate{"field", 2500, 2600}),
+            fields_range(2500, 2601));
+  ASSERT_EQ(read(io::RangePredicate{"signed", 0, 10}),
+            fields_range(kZero, kZero + 11));
+  ASSERT_EQ(read(io::RangePredicate{"signed", 1000}),
+            fields_range(kZero + 1000, kRows));
+  ASSERT_TRUE(read(io::RangePredicate{"signed", 1ul << 63}).empty());
+
+  std::filesystem::remove(kDataFile);
+}
+
+TEST(BinaryOStream, CloseReportsWriteErrors) {
+  // /dev/full fails every write with ENOSPC, rows that fit the buffer are
+  // only written by Close, compressed ones on the background thread
+  for (const auto codec :
+       {arrow::Compression::UNCOMPRESSED, arrow::Compression::ZSTD}) {
+    io::SpillOptions spill;
+    spill.codec = codec;
+    const io::BufferSettings settings(1024, 4, sizeof(Row), spill);
+
+    io::BinaryOStream<Row> output("/dev/full", settings);
+    for (uint64_t key = 0; key != 64; ++key) {
+      output << Row{key};
+    }
+    ASSERT_FALSE(output.Close().ok());
+  }
+}
+
+TEST(IpcOStream, CloseReportsWriteErrors) {
+  const io::BufferSettings settings(1024, 4, sizeof(Row));
+  io::IpcOStream<Row> output("/dev/full", settings);
+  for (uint64_t key = 0; key != 64; ++key) {
+    output << Row{key};
+  }
+  ASSERT_FALSE(output.Close().ok());
+}
+
+TEST(MergeSort, OrderedInputOneRun) {
+  // every block of ordered input extends the first run, which is then the
+  // whole output
+  static constexpr size_t kRows = 1ul << 20;
+  const std::string sorted_file = ".tmp_sorted_input";
+  PARQUET_THROW_NOT_OK(
+      generators::GenerateParquet(kDataFile, kGenSchema, kRows, 1ul << 16));
+
+  sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(kRows, RowKey);
+  auto result =
+      sorting::MergeSort<Row, io::BatchIStream<Row>,
+                         models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+          kDataFile, sorted_file, 256, buffer);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+
+  sorting::RadixSortBuffer<Row, decltype(&RowKey)> small_buffer(kRows / 8,
+                                                                RowKey);
+  result =
+      sorting::MergeSort<Row, io::BatchIStream<Row>,
+                         models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+          sorted_file, kTmpOutputFile, 256, small_buffer);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  ASSERT_EQ(parquet::ParquetFileReader::OpenFile(kTmpOutputFile)
+                ->metadata()
+                ->num_rows(),
+            kRows);
+  AssertOrder();
+
+  std::filesystem::remove(sorted_file);
+  std::filesystem::remove(kDataFile);
+}
+
+TEST_F(SmallDataTest, SortService) {
+  std::vector<std::future<arrow::Status>> results;
+  {
+    sorting::SortService service(512_MiB, 16_GiB, 4,
+                                 {".tmp_service_0/", ".tmp_service_1/"});
+    for (size_t job_ind = 0; job_ind != 3; ++job_ind) {
+      results.push_back(service.Submit(
+          256_MiB, 4_GiB, [job_ind](const sorting::SortJob &job) {
+            sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+                job.memory / sizeof(Row), RowKey);
+            return sorting::MergeSort<Row, io::BatchIStream<Row>,
+                                      models::BinaryStreams<Row>,
+                                      io::BatchOStream<Row>>(
+                       kDataFile, kTmpOutputFile + std::to_string(job_ind),
+                       256, buffer, job.Options())
+                .status();
+          }));
+    }
+  }
+
+  for (size_t job_ind = 0; job_ind != results.size(); ++job_ind) {
+    ASSERT_EQ(results[job_ind].get(), arrow::Status::OK());
+    std::filesystem::rename(kTmpOutputFile + std::to_string(job_ind),
+                            kTmpOutputFile);
+    AssertOrder();
+  }
+  // the service created its spill directories and removed them
+  ASSERT_FALSE(std::filesystem::exists(".tmp_service_0/"));
+  ASSERT_FALSE(std::filesystem::exists(".tmp_service_1/"));
+}
+
+TEST(SpillSpace, SharedDirectory) {
+  sorting::SpillSpace first({sorting::kTmpSortDir});
+  sorting::SpillSpace second({sorting::kTmpSortDir});
+  first.Create();
+  second.Create();
+  const std::string path = first.Path(0);
+  ASSERT_NE(second.Path(0), path);
+  std::ofstream(path) << "run";
+
+  second.Remove();
+  ASSERT_TRUE(std::filesystem::exists(path));
+  first.Remove();
+  ASSERT_FALSE(std::filesystem::exists(sorting::kTmpSortDir));
+
+  // the job that created the directory may leave it first
+  first.Create();
+  second.Create();
+  first.Remove();
+  ASSERT_TRUE(std::filesystem::exists(sorting::kTmpSortDir));
+  second.Remove();
+  ASSERT_FALSE(std::filesystem::exists(sorting::kTmpSortDir));
 }
 
 TEST_F(DataTest, BucketSort) {
@@ -94,6 +435,600 @@ TEST_F(DataTest, BucketSort) {
     ASSERT_EQ(result, arrow::Status::OK());
     AssertOrder();
   }
+  {
+    const std::string parts_dir = ".tmp_partitions/";
+    sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+        500_MiB / sizeof(Row), RowKey);
+    sorting::SortOptions options;
+    options.partitions = 4;
+
+    const auto result =
+        sorting::BucketSort<Row, io::BatchIStream<Row>,
+                            models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+            kDataFile, parts_dir, 256, buffer, 0, -1ul, options);
+    ASSERT_EQ(result, arrow::Status::OK());
+    ASSERT_TRUE(
+        std::filesystem::exists(parts_dir + sorting::kPartitionManifest));
+    ASSERT_EQ(io::ListInputFiles(parts_dir).size(), 4);
+
+    // parts read back in name order form the sorted output
+    io::ParquetSettings settings(512_MiB, 1 << 16, parts_dir);
+    io::DatasetIStream<Row> input(parts_dir, settings);
+    Row row;
+    uint64_t prev = 0;
+    while (!input.Eof()) {
+      input >> row;
+      ASSERT_LE(prev, RowKey(row));
+      prev = RowKey(row);
+    }
+
+    std::filesystem::remove_all(parts_dir);
+  }
+}
+
+TEST(PartitionedOStream, SkippedPartitions) {
+  PARQUET_THROW_NOT_OK(
+      generators::GenerateParquet(kDataFile, kGenSchema, 16, 16));
+  const std::string parts_dir = ".tmp_partitions/";
+  const io::ParquetSettings settings(1_MiB, 256, kDataFile);
+
+  // partitions end at keys 10, 20, 30 and 100, the middle two stay empty
+  sorting::PartitionedOStream<Row, io::BatchOStream<Row>, decltype(&RowKey)>
+      output(parts_dir, settings, RowKey, 4);
+  output.Partition({10, 20, 30, 40}, 0, 100);
+  for (const uint64_t key : {5, 6, 50, 60}) {
+    output << Row{key};
+  }
+  ASSERT_EQ(output.Close(), arrow::Status::OK());
+
+  const std::vector<int64_t> expected = {2, 0, 0, 2};
+  for (size_t ind = 0; ind != expected.size(); ++ind) {
+    const std::string part =
+        parts_dir + "part-" + std::to_string(ind) + ".parquet";
+    ASSERT_EQ(
+        parquet::ParquetFileReader::OpenFile(part)->metadata()->num_rows(),
+        expected[ind]);
+  }
+
+  std::filesystem::remove_all(parts_dir);
+  std::filesystem::remove(kDataFile);
+}
+
+TEST_F(DataTest, LateMaterializationSort) {
+  const auto result = sorting::LateMaterializationSort<
+      Row, models::BinaryStreams<sorting::RowRef>, io::BatchOStream<Row>>(
+      kDataFile, kTmpOutputFile, 256, 512_MiB, &RowKey);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  AssertOrder();
+}
+
+TEST(LateMaterializationSort, OneFullBlock) {
+  // the references fill the buffer exactly once and form a single run
+  static constexpr size_t kRows = 1ul << 16;
+  PARQUET_THROW_NOT_OK(
+      generators::GenerateParquet(kDataFile, kGenSchema, kRows, 1ul << 12));
+
+  const auto result = sorting::LateMaterializationSort<
+      Row, models::BinaryStreams<sorting::RowRef>, io::BatchOStream<Row>>(
+      kDataFile, kTmpOutputFile, 256, kRows * sizeof(sorting::RowRef),
+      &RowKey);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  ASSERT_EQ(parquet::ParquetFileReader::OpenFile(kTmpOutputFile)
+                ->metadata()
+                ->num_rows(),
+            kRows);
+  AssertOrder();
+
+  std::filesystem::remove(kDataFile);
+}
+
+IOFIELD(uint64_t, tag);
+using TaggedRow = io::Row<IOFieldNfield, IOFieldNtag>;
+
+inline uint64_t TaggedRowKey(const TaggedRow &row) { return row.field; }
+
+TEST(LateMaterializationSort, SeveralChunks) {
+  // the gather takes a quarter of the rows per chunk, and the key pass
+  // decodes only the key column
+  static constexpr size_t kRows = 1ul << 16;
+  const auto schema = std::make_tuple(
+      generators::FieldToGenerate("field",
+                                  std::uniform_int_distribution<uint64_t>{}),
+      generators::FieldToGenerate("tag",
+                                  std::uniform_int_distribution<uint64_t>{}));
+  PARQUET_THROW_NOT_OK(
+      generators::GenerateParquet(kDataFile, schema, kRows, 1ul << 12));
+
+  // order-independent digest of the rows, tags have to follow their keys
+  const auto digest = [](const std::string &filename) {
+    io::ParquetSettings settings(64_MiB, 1ul << 12, filename);
+    io::BatchIStream<TaggedRow> input(filename, settings);
+
+    TaggedRow row;
+    uint64_t prev = 0;
+    size_t rows = 0;
+    uint64_t hash = 0;
+    while (!input.Eof()) {
+      input >> row;
+      EXPECT_LE(prev, row.field);
+      prev = row.field;
+      hash += row.field ^ (row.tag * 31);
+      ++rows;
+    }
+    EXPECT_EQ(rows, kRows);
+    return hash;
+  };
+  uint64_t expected = 0;
+  {
+    io::ParquetSettings settings(64_MiB, 1ul << 12, kDataFile);
+    io::BatchIStream<TaggedRow> input(kDataFile, settings);
+    TaggedRow row;
+    while (!input.Eof()) {
+      input >> row;
+      expected += row.field ^ (row.tag * 31);
+    }
+  }
+
+  const auto sort = [](const std::string &key_column) {
+    return sorting::LateMaterializationSort<
+        TaggedRow, models::BinaryStreams<sorting::RowRef>,
+        io::BatchOStream<TaggedRow>>(kDataFile, kTmpOutputFile, 256,
+                                     kRows * sizeof(TaggedRow) / 4,
+                                     &TaggedRowKey, {sorting::kTmpSortDir},
+                                     key_column);
+  };
+  ASSERT_FALSE(sort("missing").ok());
+
+  const auto result = sort("field");
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  ASSERT_EQ(digest(kTmpOutputFile), expected);
+  // unordered keys touch every row group in each of the four chunks
+  const int row_groups = parquet::ParquetFileReader::OpenFile(kDataFile)
+                             ->metadata()
+                             ->num_row_groups();
+  ASSERT_EQ(result->gather_row_groups, 4 * row_groups);
+
+  std::filesystem::remove(kTmpOutputFile);
+  std::filesystem::remove(kDataFile);
+}
+
+TEST_F(DataTest, ArrowMergeSort) {
+  const auto result = sorting::ArrowMergeSort(
+      kDataFile, kTmpOutputFile, {arrow::compute::SortKey("field")},
+      512_MiB / sizeof(Row));
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  AssertOrder();
+}
+
+TEST_F(SmallDataTest, ArrowMergeSortPasses) {
+  // a run per row group, merged four at a time
+  const auto result = sorting::ArrowMergeSort(
+      kDataFile, kTmpOutputFile, {arrow::compute::SortKey("field")},
+      64_MiB / sizeof(Row), 1ul << 16, {}, {sorting::kTmpSortDir}, 4);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  ASSERT_FALSE(std::filesystem::exists(sorting::kTmpSortDir));
+
+  std::unique_ptr<parquet::arrow::FileReader> reader;
+  PARQUET_ASSIGN_OR_THROW(reader,
+                          sorting::details::OpenParquet(kTmpOutputFile));
+  ASSERT_EQ(reader->parquet_reader()->metadata()->num_rows(), kRows);
+  AssertOrder();
+}
+
+TEST(ArrowMergeSort, EmptyInput) {
+  const std::string empty_file = ".tmp_empty";
+  {
+    const auto schema = arrow::schema({arrow::field("field", arrow::uint64())});
+    std::shared_ptr<arrow::io::FileOutputStream> outfile;
+    PARQUET_ASSIGN_OR_THROW(outfile,
+                            arrow::io::FileOutputStream::Open(empty_file));
+    std::unique_ptr<parquet::arrow::FileWriter> writer;
+    PARQUET_ASSIGN_OR_THROW(
+        writer, parquet::arrow::FileWriter::Open(
+                    *schema, arrow::default_memory_pool(), outfile));
+    PARQUET_THROW_NOT_OK(writer->Close());
+  }
+
+  const auto result = sorting::ArrowMergeSort(
+      empty_file, kTmpOutputFile, {arrow::compute::SortKey("field")}, 1024);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+
+  std::unique_ptr<parquet::arrow::FileReader> reader;
+  PARQUET_ASSIGN_OR_THROW(reader,
+                          sorting::details::OpenParquet(kTmpOutputFile));
+  std::shared_ptr<arrow::Table> table;
+  ASSERT_EQ(reader->ReadTable(&table), arrow::Status::OK());
+  ASSERT_EQ(table->num_rows(), 0);
+  ASSERT_EQ(table->schema()->field(0)->name(), "field");
+
+  std::filesystem::remove(empty_file);
+  std::filesystem::remove(kTmpOutputFile);
+}
+
+TEST(ArrowMergeSort, StableWithNullPlacement) {
+  // runs of 256 rows with few distinct keys and nulls, merged three at a
+  // time, have to match a stable in-memory sort
+  static constexpr int64_t kRows = 4096;
+  arrow::Int64Builder key_builder;
+  arrow::UInt64Builder position_builder;
+  std::mt19937_64 gen;
+  for (int64_t ind = 0; ind != kRows; ++ind) {
+    if (gen() % 8 == 0) {
+      PARQUET_THROW_NOT_OK(key_builder.AppendNull());
+    } else {
+      PARQUET_THROW_NOT_OK(key_builder.Append(gen() % 16));
+    }
+    PARQUET_THROW_NOT_OK(position_builder.Append(ind));
+  }
+  const auto schema =
+      arrow::schema({arrow::field("key", arrow::int64()),
+                     arrow::field("position", arrow::uint64())});
+  const auto table = arrow::Table::Make(
+      schema, {*key_builder.Finish(), *position_builder.Finish()});
+  std::shared_ptr<arrow::io::FileOutputStream> outfile;
+  PARQUET_ASSIGN_OR_THROW(outfile,
+                          arrow::io::FileOutputStream::Open(kDataFile));
+  PARQUET_THROW_NOT_OK(parquet::arrow::WriteTable(
+      *table, arrow::default_memory_pool(), outfile, 256));
+  PARQUET_THROW_NOT_OK(outfile->Close());
+
+  for (const auto &sort_key :
+       {arrow::compute::SortKey("key", arrow::compute::SortOrder::Ascending,
+                                arrow::compute::NullPlacement::AtEnd),
+        arrow::compute::SortKey("key", arrow::compute::SortOrder::Descending,
+                                arrow::compute::NullPlacement::AtStart)}) {
+    arrow::compute::SortOptions sort_options({sort_key});
+    arrow::Datum inds;
+    PARQUET_ASSIGN_OR_THROW(
+        inds, arrow::compute::CallFunction("sort_indices", {table},
+                                           &sort_options));
+    arrow::Datum expected;
+    PARQUET_ASSIGN_OR_THROW(expected, arrow::compute::Take(table, inds));
+
+    const auto result = sorting::ArrowMergeSort(
+        kDataFile, kTmpOutputFile, {sort_key}, 256, 100, {},
+        {sorting::kTmpSortDir}, 3);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    PARQUET_ASSIGN_OR_THROW(reader,
+                            sorting::details::OpenParquet(kTmpOutputFile));
+    std::shared_ptr<arrow::Table> sorted;
+    ASSERT_EQ(reader->ReadTable(&sorted), arrow::Status::OK());
+    ASSERT_TRUE(sorted->GetColumnByName("position")->Equals(
+        *expected.table()->GetColumnByName("position")));
+  }
+
+  std::filesystem::remove(kTmpOutputFile);
+  std::filesystem::remove(kDataFile);
+}
+
+TEST_F(SmallDataTest, SortedOutputMetadata) {
+  sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+      64_MiB / sizeof(Row), RowKey);
+  sorting::SortOptions options;
+  options.key_column = "field";
+  options.output.delta_key = true;
+  options.output.page_index = true;
+  options.output.compression = parquet::Compression::ZSTD;
+
+  const auto assert_metadata = [] {
+    const auto reader = parquet::ParquetFileReader::OpenFile(kTmpOutputFile);
+    const auto row_group = reader->metadata()->RowGroup(0);
+    ASSERT_EQ(row_group->sorting_columns().size(), 1);
+    ASSERT_EQ(row_group->sorting_columns()[0].column_idx, 0);
+
+    const auto key_chunk = row_group->ColumnChunk(0);
+    ASSERT_EQ(key_chunk->compression(), parquet::Compression::ZSTD);
+    ASSERT_TRUE(key_chunk->GetColumnIndexLocation());
+    const auto &encodings = key_chunk->encodings();
+    ASSERT_NE(std::find(encodings.begin(), encodings.end(),
+                        parquet::Encoding::DELTA_BINARY_PACKED),
+              encodings.end());
+  };
+
+  const auto result =
+      sorting::MergeSort<Row, io::BatchIStream<Row>,
+                         models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+          kDataFile, kTmpOutputFile, 256, buffer, options);
+  ASSERT_EQ(result.status(), arrow::Status::OK());
+  assert_metadata();
+  AssertOrder();
+
+  // the key column is found in the output, not at its place in the input
+  const std::string wide_file = ".tmp_wide";
+  const auto wide_schema = std::make_tuple(
+      generators::FieldToGenerate("pad",
+                                  std::uniform_int_distribution<uint64_t>{}),
+      generators::FieldToGenerate("field",
+                                  std::uniform_int_distribution<uint64_t>{}));
+  PARQUET_THROW_NOT_OK(
+      generators::GenerateParquet(wide_file, wide_schema, 1ul << 20,
+                                  1ul << 18));
+
+  const auto wide_result =
+      sorting::MergeSort<Row, io::BatchIStream<Row>,
+                         models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+          wide_file, kTmpOutputFile, 256, buffer, options);
+  ASSERT_EQ(wide_result.status(), arrow::Status::OK());
+  assert_metadata();
+  AssertOrder();
+  std::filesystem::remove(wide_file);
+}
+
+TEST_F(SmallDataTest, StitchParquet) {
+  const std::string parts_dir = ".tmp_partitions/";
+  sorting::RadixSortBuffer<Row, decltype(&RowKey)> buffer(
+      64_MiB / sizeof(Row), RowKey);
+  sorting::SortOptions options;
+  options.partitions = 2;
+
+  const auto result =
+      sorting::BucketSort<Row, io::BatchIStream<Row>,
+                          models::BinaryStreams<Row>, io::BatchOStream<Row>>(
+          kDataFile, parts_dir, 256, buffer, 0, -1ul, options);
+  ASSERT_EQ(result, arrow::Status::OK());
+
+  const auto parts = io::ListInputFiles(parts_dir);
+  const auto num_rows = [](const std::string &filename) {
+    return parquet::ParquetFileReader::OpenFile(filename)
+        ->metadata()
+        ->num_rows();
+  };
+  const int64_t first_rows = num_rows(parts[0]);
+  const int64_t second_rows = num_rows(parts[1]);
+
+  // an output that is a later input would be truncated before it is read,
+  // a missing input is found before the first one is cut
+  ASSERT_TRUE(io::StitchParquet(parts, parts[1]).IsInvalid());
+  ASSERT_EQ(num_rows(parts[1]), second_rows);
+  ASSERT_FALSE(io::StitchParquet({parts[0], ".tmp_missing"}, parts[0]).ok());
+  ASSERT_EQ(num_rows(parts[0]), first_rows);
+
+  ASSERT_EQ(io::StitchParquet(parts, kTmpOutputFile), arrow::Status::OK());
+  ASSERT_EQ(num_rows(kTmpOutputFile), num_rows(kDataFile));
+  AssertOrder();
+
+  ASSERT_EQ(io::StitchParquet(parts, parts[0]), arrow::Status::OK());
+  ASSERT_EQ(num_rows(parts[0]), first_rows + second_rows);
+
+  std::filesystem::remove_all(parts_dir);
+}
+
+IOFIELD(std::string_view, payload);
+using StringRow = io::Row<IOFieldNfield, IOFieldNpayload>;
+
+inline uint64_t StringRowKey(const StringRow &row) { return row.field; }
+
+TEST(StringRows, MergeSort) {
+  static constexpr size_t kStringRows = 1ul << 22;
+  const auto schema = std::make_tuple(
+      generators::FieldToGenerate("field",
+                                  std::uniform_int_distribution<uint64_t>{}),
+      generators::FieldToGenerate("payload", generators::RandomString(32)));
+  PARQUET_THROW_NOT_OK(
+      generators::GenerateParquet(kDataFile, schema, kStringRows, 1ul << 20));
+
+  // order-independent digest of the rows, payloads are checked to survive
+  // spilling and merging intact
+  const auto digest = [](const std::string &filename, bool sorted) {
+    io::ParquetSettings settings(64_MiB, 1ul << 16, filename);
+    io::BatchIStream<StringRow> input(filename, settings);
+
+    StringRow row;
+    uint64_t prev = 0;
+    size_t hash = 0;
+    while (!input.Eof()) {
+      input >> row;
+      if (sorted) {
+        EXPECT_LE(prev, row.field);
+      }
+      prev = row.field;
+      hash += row.field ^ std::hash<std::string_view>{}(row.payload);
+    }
+    return hash;
+  };
+  const size_t expected = digest(kDataFile, false);
+
+  {
+    sorting::SortBuffer<StringRow, decltype(&StringRowKey)> buffer(
+        kStringRows / 8, StringRowKey);
+    const auto result =
+        sorting::MergeSort<StringRow, io::BatchIStream<StringRow>,
+                           models::BinaryStreams<StringRow>,
+                           io::BatchOStream<StringRow>>(
+            kDataFile, kTmpOutputFile, 256, buffer);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    ASSERT_EQ(digest(kTmpOutputFile, true), expected);
+  }
+  {
+    sorting::ColumnarSortBuffer<StringRow, decltype(&StringRowKey)> buffer(
+        kStringRows / 8, StringRowKey);
+    const auto result = sorting::MergeSort<
+        StringRow, io::BatchIStream<StringRow>,
+        models::KeyedBinaryStreams<StringRow, decltype(&StringRowKey)>,
+        io::BatchOStream<StringRow>>(kDataFile, kTmpOutputFile, 256, buffer);
+    ASSERT_EQ(result.status(), arrow::Status::OK());
+    ASSERT_EQ(digest(kTmpOutputFile, true), expected);
+  }
+
+  std::filesystem::remove(kTmpOutputFile);
+  std::filesystem::remove(kDataFile);
+}
+
+// Wider than a key and index pair, so scratch rows can hold the key column
+// of IndicesSortBuffer
+struct WideRow {
+  uint64_t field;
+  uint64_t position;
+  uint64_t pad[2];
+
+  bool operator==(const WideRow &) const = default;
+};
+
+inline uint64_t WideRowKey(const WideRow &row) { return row.field; }
+
+// `sorted` must hold the rows of `rows` in key order. The sorts are not
+// stable, so rows with equal keys are put back in input order by their
+// positions, after which whole rows have to match std::stable_sort.
+template <class R>
+void AssertSortedRows(std::vector<R> sorted, const std::vector<R> &rows) {
+  const auto by_key = [](const R &lhs, const R &rhs) {
+    return lhs.field < rhs.field;
+  };
+  ASSERT_TRUE(std::is_sorted(sorted.begin(), sorted.end(), by_key));
+  std::sort(sorted.begin(), sorted.end(), [](const R &lhs, const R &rhs) {
+    return std::tie(lhs.field, lhs.position) <
+           std::tie(rhs.field, rhs.position);
+  });
+
+  std::vector<R> expected = rows;
+  std::stable_sort(expected.begin(), expected.end(), by_key);
+  ASSERT_EQ(sorted.size(), expected.size());
+  for (size_t ind = 0; ind != sorted.size(); ++ind) {
+    ASSERT_TRUE(sorted[ind] == expected[ind]) << ind;
+  }
+}
+
+// Sorts `size` rows keyed below `range` (any key if 0) in `buffer`
+template <class Buffer>
+void AssertSortsRows(Buffer &buffer, size_t size, uint64_t range) {
+  std::mt19937_64 gen(size);
+  std::vector<WideRow> rows(size);
+  for (size_t ind = 0; ind != size; ++ind) {
+    rows[ind] = {range ? gen() % range : gen(), ind, {gen(), ind}};
+    buffer[ind] = rows[ind];
+  }
+  buffer.Sort(size);
+
+  std::vector<WideRow> sorted(size);
+  for (size_t ind = 0; ind != size; ++ind) {
+    sorted[ind] = buffer[ind];
+  }
+  AssertSortedRows(sorted, rows);
+}
+
+TEST(SortPairs, ScalarAndAvx2) {
+  for (const bool avx2 : {false, true}) {
+    if (avx2 && !sorting::details::HasAvx2()) {
+      continue;
+    }
+    for (const size_t size : {0, 1, 3, 4, 15, 16, 17, 33, 1000}) {
+      for (const uint64_t range : {4ul, 0ul}) {
+        std::mt19937_64 gen(size);
+        std::vector<uint64_t> keys(size);
+        std::vector<size_t> inds(size);
+        for (size_t ind = 0; ind != size; ++ind) {
+          keys[ind] = range ? gen() % range : gen();
+          inds[ind] = ind;
+        }
+        const std::vector<uint64_t> original = keys;
+
+        std::vector<uint64_t> extra_keys(size);
+        std::vector<size_t> extra_inds(size);
+        sorting::details::SortPairs(keys.data(), inds.data(),
+                                    extra_keys.data(), extra_inds.data(), size,
+                                    avx2);
+
+        std::vector<uint64_t> expected = original;
+        std::sort(expected.begin(), expected.end());
+        ASSERT_EQ(keys, expected) << avx2 << " " << size;
+        for (size_t ind = 0; ind != size; ++ind) {
+          ASSERT_EQ(original[inds[ind]], keys[ind]);
+        }
+      }
+    }
+  }
+}
+
+TEST(IndicesSortBuffer, KeyColumnInScratchRows) {
+  for (const bool scratch_rows : {false, true}) {
+    sorting::MemoryOptions memory;
+    memory.scratch_rows = scratch_rows;
+    for (const size_t size : {0, 1, 1000, 65536}) {
+      for (const uint64_t range : {16ul, 0ul}) {
+        sorting::IndicesSortBuffer<WideRow, decltype(&WideRowKey)> buffer(
+            size, WideRowKey, memory);
+        AssertSortsRows(buffer, size, range);
+      }
+    }
+  }
+}
+
+// Around the 256 buckets of a radix digit and the 2^16 rows from which
+// radix sorts scan key ranges and plan LSD passes
+const std::vector<size_t> kSortSizes = {0, 1, 255, 256, 257, 65535, 65536};
+
+TEST(RadixSortBuffer, MatchesStableSort) {
+  for (const size_t size : kSortSizes) {
+    for (const uint64_t range : {1000ul, 1ul << 20, 0ul}) {
+      sorting::RadixSortBuffer<WideRow, decltype(&WideRowKey)> rows(
+          size, WideRowKey);
+      AssertSortsRows(rows, size, range);
+      sorting::RadixIndicesSortBuffer<WideRow, decltype(&WideRowKey)> inds(
+          size, WideRowKey);
+      AssertSortsRows(inds, size, range);
+    }
+  }
+}
+
+// A key and its input position, small enough for LSD on 33 bit keys
+struct NarrowRow {
+  uint64_t field;
+  uint64_t position;
+
+  bool operator==(const NarrowRow &) const = default;
+};
+
+inline uint64_t NarrowRowKey(const NarrowRow &row) { return row.field; }
+
+TEST(RadixSort, Plans) {
+  struct Case {
+    size_t size;
+    uint64_t range;
+    sorting::details::RadixPlan plan;
+  };
+  // one LSD pass, 8 and 11 bit LSD digits, MSD on small blocks and on wide
+  // key ranges
+  const std::vector<Case> cases = {
+      {65536, 1ul << 10, {true, 11}}, {65536, 1ul << 16, {true, 8}},
+      {65536, 1ul << 20, {true, 11}}, {65536, 1ul << 32, {true, 11}},
+      {65535, 1ul << 20, {false, 8}}, {65536, 0, {false, 8}},
+  };
+
+  for (const auto &test : cases) {
+    SCOPED_TRACE(std::to_string(test.size) + " " + std::to_string(test.range));
+    std::mt19937_64 gen(test.size);
+    std::vector<NarrowRow> rows(test.size);
+    for (size_t ind = 0; ind != test.size; ++ind) {
+      rows[ind] = {test.range ? gen() % test.range : gen(), ind};
+    }
+
+    const auto [min, max] = sorting::details::KeyRange<uint64_t>(
+        rows.data(), rows.size(), NarrowRowKey);
+    const auto plan = sorting::details::PlanRadix(
+        test.size, 64 - std::countl_zero(max - min), sizeof(NarrowRow));
+    ASSERT_EQ(plan.lsd, test.plan.lsd);
+    ASSERT_EQ(plan.bits, test.plan.bits);
+
+    std::vector<NarrowRow> sorted = rows;
+    std::vector<NarrowRow> extra(test.size);
+    sorting::RadixSort(sorted, extra, sorted.size(),
+                       std::numeric_limits<uint64_t>::min(),
+                       std::numeric_limits<uint64_t>::max(), NarrowRowKey);
+    AssertSortedRows(sorted, rows);
+  }
+}
+
+TEST(RadixKeyedIndicesSortBuffer, PackedAndWide) {
+  // key ranges of up to 32 bits sort packed words, wider ones key-index pairs
+  for (const size_t size : kSortSizes) {
+    for (const uint64_t range : {1000ul, 1ul << 32, 1ul << 33, 0ul}) {
+      sorting::RadixKeyedIndicesSortBuffer<WideRow, decltype(&WideRowKey)>
+          buffer(size, WideRowKey);
+      AssertSortsRows(buffer, size, range);
+    }
+  }
 }
 
 int main(int argc, char **argv) {